@@ -2,67 +2,92 @@
 #include "WordExpander.h"
 #include <stdio.h>
 #include <variant>
+#include <cassert>
 
-bool CommandExpander::expand()
+bool CommandExpander::expand_into(Command &expanded)
 {
-    if(std::holds_alternative<Command::Simple>(m_command->value)) {
-        // values of assigned variables should always be space-joined
-        // so that when $IFS starts with ' ', `var="$@"` is to be equivalent to `var="$*"`
-        // and `var=$(echo a b)` equivalent to `var='a b'`
-        auto &simple_command = std::get<Command::Simple>(m_command->value);
-        for (auto& assignment : simple_command.variable_assignments) {
-            std::string expanded;
+    assert(std::holds_alternative<Command::Simple>(m_command.value));
+    const auto &simple_command = std::get<Command::Simple>(m_command.value);
 
-            WordExpander::Options opt;
-            opt.commonExpansions = true;
-            opt.fieldSplitting = false;
-            opt.pathnameExpansion = WordExpander::Options::NEVER;
-            opt.variableAtAsMultipleFields = false;
-            if(! WordExpander(opt, assignment.value).expand_into(expanded)) {
-                word_expansion_failed(assignment.value);
-                return false;
-            }
+    if(!std::holds_alternative<Command::Simple>(expanded.value))
+        expanded.value.emplace<Command::Simple>();
+    auto &expanded_simple = std::get<Command::Simple>(expanded.value);
+    expanded_simple.argv.clear();
+    expanded_simple.argv_tokens.clear();
+    expanded_simple.variable_assignments.resize(simple_command.variable_assignments.size());
+
+    expanded.start_token = m_command.start_token;
+    expanded.end_token = m_command.end_token;
 
-            assignment.value = expanded;
+    // values of assigned variables should always be space-joined
+    // so that when $IFS starts with ' ', `var="$@"` is to be equivalent to `var="$*"`
+    // and `var=$(echo a b)` equivalent to `var='a b'`
+    for (std::size_t i = 0; i < simple_command.variable_assignments.size(); i++) {
+        const auto &assignment = simple_command.variable_assignments[i];
+        auto &expanded_assignment = expanded_simple.variable_assignments[i];
+
+        WordExpander::Options opt;
+        opt.commonExpansions = true;
+        opt.fieldSplitting = false;
+        opt.pathnameExpansion = WordExpander::Options::NEVER;
+        opt.variableAtAsMultipleFields = false;
+        expanded_assignment.name = assignment.name;
+        if(! WordExpander(opt, assignment.compiled_value, assignment.value).expand_into(expanded_assignment.value)) {
+            word_expansion_failed(assignment.value);
+            return false;
         }
     }
 
-    for (auto& redirection : m_command->redirections) {
+    if(!expand_redirections_into(expanded.redirections))
+        return false;
+
+    for (std::size_t i = 0; i < simple_command.argv.size(); i++) {
+        const std::string &arg = simple_command.argv[i];
+        WordExpander::Options opt;
+        opt.commonExpansions = true;
+        opt.fieldSplitting = true;
+        opt.pathnameExpansion = WordExpander::Options::ALWAYS;
+        opt.variableAtAsMultipleFields = true;
+        // Commands that weren't parsed from text don't have their words compiled
+        WordExpander expander = i < simple_command.compiled_argv.size()
+            ? WordExpander(opt, simple_command.compiled_argv[i], arg)
+            : WordExpander(opt, arg);
+        if (!expander.expand_into(expanded_simple.argv)) {
+            fprintf(stderr, "Shell: %s: failed expanding word\n", arg.c_str());
+        }
+    }
+
+    return true;
+}
+
+bool CommandExpander::expand_redirections_into(Redirections &expanded)
+{
+    expanded.clear();
+
+    for (const auto& redirection : m_command.redirections) {
+        Redirection &expanded_redirection = expanded.emplace_back();
+        expanded_redirection.type = redirection.type;
+        expanded_redirection.fd = redirection.fd;
+        expanded_redirection.rewire_fd = redirection.rewire_fd;
+        expanded_redirection.filename_token = redirection.filename_token;
+
         if(redirection.type != Redirection::Rewiring) {
-            std::vector<std::string> expanded;
+            std::vector<std::string> expanded_path;
 
             WordExpander::Options opt;
             opt.commonExpansions = true;
             opt.fieldSplitting = false;
             opt.pathnameExpansion = WordExpander::Options::ONLY_IF_SINGLE_RESULT;
             opt.variableAtAsMultipleFields = false;
-            if(! WordExpander(opt, redirection.path).expand_into(expanded)) {
+            if(! WordExpander(opt, redirection.compiled_path, redirection.path).expand_into(expanded_path)) {
                 word_expansion_failed(redirection.path);
                 return false;
             }
-            if (expanded.size() != 1) {
+            if (expanded_path.size() != 1) {
                 fprintf(stderr, "Shell: %s: ambiguous redirect\n", redirection.path.c_str());
                 return false;
             }
-            redirection.path = std::move(expanded[0]);
-        }
-    }
-
-
-    if(std::holds_alternative<Command::Simple>(m_command->value)) {
-        auto &simple_command = std::get<Command::Simple>(m_command->value);
-
-        std::vector<std::string> unexpanded_argv = simple_command.argv;
-        simple_command.argv.clear();
-        for (const std::string& arg : unexpanded_argv) {
-            WordExpander::Options opt;
-            opt.commonExpansions = true;
-            opt.fieldSplitting = true;
-            opt.pathnameExpansion = WordExpander::Options::ALWAYS;
-            opt.variableAtAsMultipleFields = true;
-            if (!WordExpander(opt, arg).expand_into(simple_command.argv)) {
-                fprintf(stderr, "Shell: %s: failed expanding word\n", arg.c_str());
-            }
+            expanded_redirection.path = std::move(expanded_path[0]);
         }
     }
 
@@ -73,4 +98,3 @@ void CommandExpander::word_expansion_failed(const std::string &word)
 {
     fprintf(stderr, "Shell: %s: word expansion failed\n", word.c_str());
 }
-
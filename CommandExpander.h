@@ -5,16 +5,23 @@
 
 #include "Parser.h"
 
+// Expands the words of a parsed command into a separate Command, so that the parsed one
+// is never modified and can be run again (for example in a loop) without being copied first
 class CommandExpander {
 public:
-    explicit CommandExpander(Command* command) 
+    explicit CommandExpander(const Command &command)
         : m_command(command)
     { }
 
-    bool expand();
+    // Expands a simple command: variable assignments, redirections and argv.
+    // `expanded` can be reused between calls, so that only the expanded words themselves are allocated
+    bool expand_into(Command &expanded);
+
+    // Expands only the redirections - compound commands run their bodies straight from the parsed command
+    bool expand_redirections_into(Redirections &expanded);
 
 private:
-    Command* m_command;
+    const Command &m_command;
     void expand_word(const std::string& word, std::vector<std::string> &out);
     void word_expansion_failed(const std::string &word);
 };
@@ -22,6 +22,12 @@ std::optional<std::string> Global::get_variable(const std::string &name)
         return std::to_string(g.last_return_value);
     }
 
+    if(name == "!") {
+        if(g.last_background_pid.has_value())
+            return std::to_string(g.last_background_pid.value());
+        return {};
+    }
+
     // $0, $1, ${123}, ...
     if(name.length() >= 1 && utils::no_locale_isdigit(name.at(0))) {
         size_t arg_i = atoll(name.c_str());
@@ -45,6 +51,16 @@ std::optional<std::string> Global::get_variable(const std::string &name)
         return std::to_string(g.argv.size() - 1);
     }
 
+    if(name == "PIPESTATUS") {
+        std::string statuses;
+        for(int status : g.pipestatus) {
+            if(!statuses.empty())
+                statuses.push_back(' ');
+            statuses.append(std::to_string(status));
+        }
+        return { statuses };
+    }
+
     if(name == "PWD") {
         if(std::optional<std::string> pwd = get_pwd()) {
             return { *pwd };
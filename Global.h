@@ -2,13 +2,26 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <optional>
+#include <memory>
+#include <sys/types.h>
 #include "Parser.h"
 
 struct Global {
-    std::unordered_map<std::string, CommandList> functions;
+    std::unordered_map<std::string, std::shared_ptr<const CommandList>> functions;
 
     std::unordered_map<std::string, std::string> variables;
     int last_return_value = 0; // "$?"
+    std::optional<pid_t> last_background_pid; // "$!"
+
+    // Exit statuses of every command of the last pipeline - "$PIPESTATUS"
+    std::vector<int> pipestatus;
+
+    // Changed with `set -o`/`set +o`
+    struct Options {
+        bool pipefail = false;
+        bool bytecode = false; // run scripts and functions with the bytecode backend
+    } options;
 
     std::vector<std::unordered_map<std::string, std::string>> scoped_variables;
 
@@ -1,6 +1,7 @@
 #include "Parser.h"
 #include "Token.h"
 #include "utils.h"
+#include "WordExpander.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -27,21 +28,27 @@ static bool is_token_assignment(const Token &token)
     return false;
 }
 
-void Parser::commit_assignment(const std::string &assignment)
+// The words are copied out of the tokens only here, once - straight into the parse tree
+
+void Parser::commit_assignment(std::string_view assignment)
 {
     size_t equals_pos = assignment.find('=');
-    std::string name = assignment.substr(0, equals_pos);
-    std::string value = assignment.substr(equals_pos + 1);
-    get_simple_command().variable_assignments.push_back({name, value});
+    std::string_view value = assignment.substr(equals_pos + 1);
+    get_simple_command().variable_assignments.push_back({
+        std::string(assignment.substr(0, equals_pos)),
+        std::string(value),
+        WordExpander::compile(value)
+    });
 }
 
-void Parser::commit_argument(const std::string &word, const Token *token_for_highlighting)
+void Parser::commit_argument(std::string_view word, const Token *token_for_highlighting)
 {
-    get_simple_command().argv.push_back(word);
+    get_simple_command().argv.emplace_back(word);
+    get_simple_command().compiled_argv.push_back(WordExpander::compile(word));
     get_simple_command().argv_tokens.push_back(token_for_highlighting);
 }
 
-void Parser::commit_redirection(const std::string &op)
+void Parser::commit_redirection(std::string_view op)
 {
     Redirection::Type type = Redirection::FileWrite;
     int fd { 1 };
@@ -60,14 +67,13 @@ void Parser::commit_redirection(const std::string &op)
 
     const Token *next = input_next_token();
     if (next == nullptr) {
-        throw SyntaxError{"End of input after a redirection operator"};
+        throw SyntaxError{"End of input after a redirection operator", true};
     }
     if (next->type == Token::Type::OPERATOR) {
         throw SyntaxError{"operator or newline after a redirection operator (expected a word)"};
     }
     
-    // note: next->value cannot be std::moved because it could be used again in the highlighter
-    m_command.redirections.push_back({type, fd, -1, next->value, next});
+    m_command.redirections.push_back({type, fd, -1, std::string(next->value), next, WordExpander::compile(next->value)});
 }
 
 void Parser::commit_command()
@@ -94,7 +100,7 @@ void Parser::commit_pipeline(const Token* op)
     if (m_pipeline.commands.empty() && m_pipeline.negation_prefix == false)
         return;
 
-    m_and_or_list.push_back({std::move(m_pipeline), op ? op->value : ""});
+    m_and_or_list.push_back({std::move(m_pipeline), op ? std::string(op->value) : ""});
     m_pipeline = {};
 }
 
@@ -103,7 +109,7 @@ void Parser::commit_and_or_list(const Token* op)
     if (m_and_or_list.empty())
         return;
 
-    m_command_list.push_back({std::move(m_and_or_list), op ? op->value : ""});
+    m_command_list.push_back({std::move(m_and_or_list), op ? std::string(op->value) : ""});
     m_and_or_list = {};
 }
 
@@ -157,6 +163,7 @@ void Parser::read_commit_until() {
 
 void Parser::for_loop_add_item(const Token *token) {
     get_for_command().items.emplace_back(token->value);
+    get_for_command().compiled_items.push_back(WordExpander::compile(token->value));
     get_for_command().items_tokens.emplace_back(token);
 }
 
@@ -166,22 +173,23 @@ void Parser::for_loop_add_item(const Token *token) {
 void Parser::read_commit_for() {
     const Token *variable_name = input_next_token();
     if(variable_name == nullptr)
-        throw SyntaxError{"End of input"};
+        throw SyntaxError{"End of input", true};
 
     if(variable_name->type == Token::Type::OPERATOR) {
         throw SyntaxError{variable_name};
     }
-    get_for_command().varname = variable_name->value;
+    get_for_command().varname = std::string(variable_name->value);
 
     // token: `for x [in|do|;|\n]`
     const Token *after_varname = input_next_token();
     if(after_varname == nullptr)
-        throw SyntaxError{"End of input"};
+        throw SyntaxError{"End of input", true};
 
     if(after_varname->type == Token::Type::OPERATOR && (after_varname->value == ";" || after_varname->value == "\n")) {
         // The `for var; do ...` form
 
         get_for_command().items = {"\"$@\""}; // `for var; do`  ==  `for var in "$@"; do`
+        get_for_command().compiled_items.push_back(WordExpander::compile(get_for_command().items.back()));
     } else if(after_varname->type == Token::Type::WORD && after_varname->value == "in") {
         // The `for var in WORD...; do ...` form
 
@@ -196,7 +204,7 @@ void Parser::read_commit_for() {
         }
 
         if(after_varname == nullptr)
-            throw SyntaxError{"End of input"};
+            throw SyntaxError{"End of input", true};
     } else if(after_varname->type == Token::Type::WORD && after_varname->value == "do") {
         // The `for var do ...` form
 
@@ -208,12 +216,12 @@ void Parser::read_commit_for() {
     const Token *compound_start = input_next_token();
 
     if(compound_start == nullptr)
-        throw SyntaxError{"End of input"};
+        throw SyntaxError{"End of input", true};
 
     while(compound_start->type == Token::Type::OPERATOR && compound_start->value == "\n") {
         compound_start = input_next_token();
         if(compound_start == nullptr)
-            throw SyntaxError{"End of input"};
+            throw SyntaxError{"End of input", true};
     }
 
     if(compound_start->type == Token::Type::WORD && compound_start->value == "do") {
@@ -233,15 +241,18 @@ void Parser::read_commit_for() {
 void Parser::read_commit_function_definition()
 {
     std::string function_name = get_simple_command().argv.at(0);
-    m_command.value = Command::FunctionDefinition{.name = function_name, .body = {}};
+    m_command.value = Command::FunctionDefinition{.name = function_name, .body = nullptr};
 
     const Token *after_function_name = input_next_token();
     if(after_function_name == nullptr)
-        throw SyntaxError{"End of input"};
+        throw SyntaxError{"End of input", true};
 
     if(after_function_name->type == Token::Type::WORD && after_function_name->value == "{") {
         // The `fname() { ...; }` form
-        read_command_list_into_until(command_get<Command::FunctionDefinition>().body, {"}"});
+        // The body outlives the rest of the tree it's parsed with, so it gets an arena of its own
+        auto body = std::make_shared<OwnedCommandList>();
+        read_command_list_into_until(body->commands, {"}"}, &body->arena);
+        command_get<Command::FunctionDefinition>().body = std::shared_ptr<const CommandList>(body, &body->commands);
     } else {
         // Something else, like `fname() echo 1`
 
@@ -252,13 +263,14 @@ void Parser::read_commit_function_definition()
     }
 }
 
-const Token * Parser::read_command_list_into_until(CommandList& into, const std::vector<std::string_view> &until_commands)
+const Token * Parser::read_command_list_into_until(CommandList& into, const std::vector<std::string_view> &until_commands,
+                                                   std::pmr::memory_resource *arena)
 {
     auto sub_tokens = m_input.subspan(m_input_i);
 
     size_t displacement;
     const Token *end_token;
-    std::tie(into, displacement, end_token) = Parser(sub_tokens).parse_until(until_commands);
+    std::tie(into, displacement, end_token) = Parser(sub_tokens, arena ? arena : m_arena).parse_until(until_commands);
     m_input_i += displacement;
 
     return end_token;
@@ -464,7 +476,7 @@ void Parser::parse_token(const Token *token) {
              || token->value == "done"
              || token->value == "esac"
              || token->value == "!")) {
-        throw SyntaxError{"Unexpected token '" + token->value + "'"};
+        throw SyntaxError{"Unexpected token '" + std::string(token->value) + "'"};
     }
     // Function definition
     else if (can_be_function_definition && token->type == Token::Type::OPERATOR && token->value == "()") {
@@ -507,6 +519,19 @@ CommandList Parser::parse()
     return std::move(m_command_list);
 }
 
+std::optional<CommandList> Parser::parse_complete_command()
+{
+    while (const Token * token = input_next_token()) {
+        parse_token(token);
+
+        // Newlines inside of compound commands are read by read_commit_*(), so this one ends the command
+        if (token->type == Token::Type::OPERATOR && token->value == "\n")
+            return std::move(m_command_list);
+    }
+
+    return std::nullopt;
+}
+
 // Similar to Parser#parse(), but ends when it sees one of the commands specified in the parameter `commands`.
 // Useful for recursively parsing language structures. For example, after a `while`, should always be a `do`
 //
@@ -531,7 +556,7 @@ std::tuple<CommandList, size_t, const Token *> Parser::parse_until(const std::ve
 
     // TODO: this should prompt for more input
     if (commands.size() == 1) {
-        throw SyntaxError{"'" + std::string(commands.at(0)) + "' expected, but got to the end of input"};
+        throw SyntaxError{"'" + std::string(commands.at(0)) + "' expected, but got to the end of input", true};
     } else {
         std::string err{"Either one of "};
         bool first = true;
@@ -545,6 +570,6 @@ std::tuple<CommandList, size_t, const Token *> Parser::parse_until(const std::ve
             first = false;
         }
         err += " expected, but got to the end of input";
-        throw SyntaxError{err};
+        throw SyntaxError{err, true};
     }
 }
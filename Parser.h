@@ -7,12 +7,42 @@
 #include <variant>
 #include <optional>
 #include <string_view>
-#include <deque>
 #include <memory>
+#include <memory_resource>
 
 // TODO: After C++20 rolls out, switch to std::span
 #include "tcb/span.hpp"
 
+struct OwnedCommandList;
+
+// A word compiled when it's parsed, so that expanding it doesn't have to scan its text again:
+// the quotes are already resolved, and the parameters, command substitutions and tildes are split out
+struct CompiledWord {
+    struct Part {
+        enum Type {
+            Literal, // `text` - field split and globbed unless quoted
+            Parameter, // `$text`, `"$text"`
+            CommandSubstitution, // `$(commands)`, `"$(commands)"`
+            Tilde, // `~text`
+            Quotes, // an opening quote: the word expands to a field, even when it's empty (`""`)
+        };
+        Type type;
+        bool quoted = false;
+        std::string text {};
+        std::shared_ptr<const OwnedCommandList> commands {};
+    };
+
+    // Words that can't be compiled (like ones with a syntax error in a `$()`) are expanded from their text
+    bool compiled = false;
+
+    // Has nothing to expand - always expands to `literal` alone
+    bool is_literal = false;
+    std::string literal {};
+
+    bool has_command_substitution = false;
+    std::pmr::vector<Part> parts;
+};
+
 // TODO: Move into Command::Redirection
 struct Redirection {
     enum Type {
@@ -28,6 +58,8 @@ struct Redirection {
 
     // nullopt if type == Type::Rewiring
     std::optional<const Token *> filename_token = std::nullopt;
+
+    CompiledWord compiled_path {};
 };
 
 template <typename T>
@@ -38,17 +70,30 @@ struct WithFollowingOperator {
 
 struct Command;
 
+// The containers of a parse tree allocate from the arena of the Parser that built it (see Parser::Parser).
+// Words stay in std::string, as that's what the expansions, builtins and exec() work with - and short ones don't allocate anyway
+
+using Redirections = std::pmr::vector<Redirection>;
+
 // POSIX: "A pipeline is a sequence of one or more commands separated by the control operator '|'."
 struct Pipeline {
-    std::vector<Command> commands;
+    std::pmr::vector<Command> commands;
     bool negation_prefix = false; // `! a | b`
 };
 
 // POSIX: "An AND-OR list is a sequence of one or more pipelines separated by the operators "&&" and "||"."
-using AndOrList = std::vector<WithFollowingOperator<Pipeline>>;
+using AndOrList = std::pmr::vector<WithFollowingOperator<Pipeline>>;
 
 // POSIX: "A list is a sequence of one or more AND-OR lists separated by the operators ';' and '&'."
-using CommandList = std::vector<WithFollowingOperator<AndOrList>>;
+using CommandList = std::pmr::vector<WithFollowingOperator<AndOrList>>;
+
+// A command list with an arena of its own, for trees that outlive the one they're parsed with:
+// function bodies and command substitutions.
+// The arena takes memory straight from the heap, not from the default resource (which is the arena of the current Parser)
+struct OwnedCommandList {
+    std::pmr::monotonic_buffer_resource arena { std::pmr::new_delete_resource() };
+    CommandList commands { &arena };
+};
 
 struct Command {
     using Empty = std::monostate;
@@ -56,13 +101,17 @@ struct Command {
         struct VariableAssignment {
             std::string name {};
             std::string value {};
+            CompiledWord compiled_value {};
         };
 
-        std::vector<VariableAssignment> variable_assignments; // TODO: this should be a smart pointer
+        using VariableAssignments = std::pmr::vector<VariableAssignment>;
+
+        VariableAssignments variable_assignments;
         std::vector<std::string> argv;
+        std::pmr::vector<CompiledWord> compiled_argv; // only in parsed commands, not in expanded ones
 
         // For syntax highlighting
-        std::vector<const Token*> argv_tokens;
+        std::pmr::vector<const Token*> argv_tokens;
     };
     struct BraceGroup { // `{ true; false; }`
         CommandList command_list;
@@ -77,7 +126,7 @@ struct Command {
 
         CommandList condition;
         CommandList then;
-        std::vector<Elif> elif;
+        std::pmr::vector<Elif> elif;
         std::optional<CommandList> opt_else;
     };
     struct While {
@@ -91,21 +140,19 @@ struct Command {
     struct For { // for varname [in WORD...]; do ...
         std::string varname;
         std::vector<std::string> items;
+        std::pmr::vector<CompiledWord> compiled_items;
         CommandList body;
 
         // For syntax highlighting
-        std::vector<const Token*> items_tokens;
+        std::pmr::vector<const Token*> items_tokens;
     };
     struct FunctionDefinition {
         std::string name;
-        CommandList body;
+        // Shared with g.functions and never modified, so defining or calling a function doesn't copy it
+        std::shared_ptr<const CommandList> body;
     };
 
-    // TODO: to prevent unneccessary copying in run_pipeline:
-    std::deque<Redirection> redirections; // TODO: this should be a smart pointer
-
-    // File descriptors to close in the main shell process after forking
-    std::deque<int> pipe_file_descriptors;
+    Redirections redirections;
 
     // For syntax highlighting: keep track where a command starts and ends
     // those pointers will only live as long as the tcb::span<const Token> input lives
@@ -117,22 +164,53 @@ struct Command {
 
 class Parser {
 public:
-    explicit Parser(tcb::span<const Token> input)
-        : m_input(input)
+    // The parsed tree is allocated from `arena`, which has to outlive it.
+    // A monotonic arena makes parsing cheap and frees the whole tree at once
+    explicit Parser(tcb::span<const Token> input, std::pmr::memory_resource *arena)
+        : m_arena_scope(arena)
+        , m_arena(arena)
+        , m_input(input)
     {}
 
     CommandList parse();
 
+    // Parses only up to the first newline that isn't inside of a compound command - one POSIX "complete command",
+    // so that it can be run before the rest of the script is even read. consumed_tokens() tells where it ended.
+    // Returns nullopt if the input ends before that newline
+    std::optional<CommandList> parse_complete_command();
+    size_t consumed_tokens() const { return m_input_i; }
+
     struct SyntaxError {
         SyntaxError(const Token *tok)
-            : explanation("Unexpected '" + tok->value + "'") // TODO: quoted(tok->value)
+            : explanation("Unexpected '" + std::string(tok->value) + "'") // TODO: quoted(tok->value)
         {}
-        SyntaxError(const std::string &explanation)
+        SyntaxError(const std::string &explanation, bool end_of_input = false)
             : explanation(explanation)
+            , end_of_input(end_of_input)
         {}
         std::string explanation;
+
+        // The input ended in the middle of a command - reading more of it could fix the error
+        bool end_of_input = false;
     };
 private:
+    // While a Parser exists, its arena is the default memory resource - so every container it creates
+    // allocates from the arena without passing it around explicitly.
+    // Declared first, to be in place before the members below are constructed
+    class ArenaScope {
+    public:
+        explicit ArenaScope(std::pmr::memory_resource *arena)
+            : m_previous(std::pmr::set_default_resource(arena))
+        {}
+        ~ArenaScope() { std::pmr::set_default_resource(m_previous); }
+
+        ArenaScope(const ArenaScope &) = delete;
+        ArenaScope &operator=(const ArenaScope &) = delete;
+    private:
+        std::pmr::memory_resource *m_previous;
+    } m_arena_scope;
+    std::pmr::memory_resource *m_arena;
+
     Command m_command;
     Pipeline m_pipeline;
     AndOrList m_and_or_list;
@@ -155,9 +233,9 @@ private:
 
     void parse_token(const Token *token);
 
-    void commit_assignment(const std::string &assignment);
-    void commit_argument(const std::string &word, const Token *token_for_highlighting);
-    void commit_redirection(const std::string &op);
+    void commit_assignment(std::string_view assignment);
+    void commit_argument(std::string_view word, const Token *token_for_highlighting);
+    void commit_redirection(std::string_view op);
 
     void read_commit_compound_command_list();
     void read_commit_if();
@@ -168,7 +246,8 @@ private:
 
     void for_loop_add_item(const Token *token);
 
-    const Token *read_command_list_into_until(CommandList& into, const std::vector<std::string_view> &until_command);
+    const Token *read_command_list_into_until(CommandList& into, const std::vector<std::string_view> &until_command,
+                                              std::pmr::memory_resource *arena = nullptr);
 
     void commit_command();
     void commit_pipeline(const Token* op = nullptr);
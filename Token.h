@@ -1,6 +1,8 @@
 #pragma once
 
+#include <memory>
 #include <string>
+#include <string_view>
 
 // POSIX: "The shell breaks the input into tokens: words and operators"
 struct Token {
@@ -10,7 +12,13 @@ struct Token {
     };
 
     Type type;
-    std::string value;
+
+    // A span of the tokenized input, which has to outlive the token - or of `rewritten`
+    std::string_view value;
+
+    // Only set for the rare tokens that aren't a plain span of the input,
+    // like a word with a line continuation (`ab\<newline>c`) in the middle of it
+    std::shared_ptr<const std::string> rewritten;
 
     // For now only used for syntax highlighting:
     int positionStart;
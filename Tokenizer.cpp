@@ -1,20 +1,117 @@
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+#if !defined(KISH_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define KISH_SCAN_AVX2
+#elif !defined(KISH_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define KISH_SCAN_SSE2
+#endif
+
 #include "Tokenizer.h"
 #include "Token.h"
 #include "utils.h"
 
 
+// What the tokenizer has to look at a character for, outside of quotes
+enum CharClass : std::uint8_t {
+    Blank = 1 << 0, // 2.3.7: ends a word
+    OperatorStart = 1 << 1, // 2.3.6
+    Quote = 1 << 2,
+    Backslash = 1 << 3,
+    Dollar = 1 << 4,
+    Digit = 1 << 5, // can start a redirection operator: `2>`
+};
+
+static constexpr std::array<std::uint8_t, 256> char_classes = [] {
+    std::array<std::uint8_t, 256> classes {};
+    for(unsigned char ch : std::string_view(" \t\r"))
+        classes[ch] |= Blank;
+    for(unsigned char ch : std::string_view("&<>;|()\n"))
+        classes[ch] |= OperatorStart;
+    classes['"'] |= Quote;
+    classes['\''] |= Quote;
+    classes['\\'] |= Backslash;
+    classes['$'] |= Dollar;
+    for(unsigned char ch = '0'; ch <= '9'; ch++)
+        classes[ch] |= Digit;
+    return classes;
+}();
+
+static bool has_class(char ch, std::uint8_t classes) {
+    return char_classes[static_cast<unsigned char>(ch)] & classes;
+}
+
+// Inside of a word, everything but these is just added to it
+static constexpr std::uint8_t word_stop_classes = Blank | OperatorStart | Quote | Backslash | Dollar;
+
+// Compares 32 or 16 bytes at a time against each of `stops`, until one of them matches.
+// Returns where that byte is - or, if none is found, where the last whole vector ended, for the caller to scan the rest
+template <typename... Stops>
+static const char *vector_find_any(const char *p, const char *end, Stops... stops) {
+#if defined(KISH_SCAN_AVX2)
+    for(; end - p >= 32; p += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i found = _mm256_setzero_si256();
+        ((found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(stops)))), ...);
+        if(unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(found)))
+            return p + __builtin_ctz(mask);
+    }
+#elif defined(KISH_SCAN_SSE2)
+    for(; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i found = _mm_setzero_si128();
+        ((found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(stops)))), ...);
+        if(unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(found)))
+            return p + __builtin_ctz(mask);
+    }
+#else
+    ((void) stops, ...);
+    (void) end;
+#endif
+    return p;
+}
+
+// The end of the run of plain characters in an unquoted word starting at `from`:
+// the first character of word_stop_classes, or `until` (which ends a subtokenized `${`)
+static size_t skip_word_characters(std::string_view input, size_t from, char until) {
+    const char *end = input.data() + input.size();
+    const char *p = vector_find_any(input.data() + from, end,
+                                    ' ', '\t', '\r', '&', '<', '>', ';', '|', '(', ')', '\n', '"', '\'', '\\', '$', until);
+    while(p < end && !has_class(*p, word_stop_classes) && *p != until)
+        p++;
+    return static_cast<size_t>(p - input.data());
+}
+
+// Like skip_word_characters(), but inside of double quotes only these mean something
+static size_t skip_double_quoted_characters(std::string_view input, size_t from) {
+    const char *end = input.data() + input.size();
+    const char *p = vector_find_any(input.data() + from, end, '"', '\\', '$');
+    while(p < end && *p != '"' && *p != '\\' && *p != '$')
+        p++;
+    return static_cast<size_t>(p - input.data());
+}
+
+// Inside of single quotes, only the closing quote does
+static size_t skip_single_quoted_characters(std::string_view input, size_t from) {
+    const void *quote = memchr(input.data() + from, '\'', input.size() - from);
+    return quote ? static_cast<size_t>(static_cast<const char *>(quote) - input.data()) : input.size();
+}
+
 static bool can_start_redirection_specified_fd(char c1, char c2) {
-    return utils::strchr_no_null("<>", c2) != nullptr && utils::no_locale_isdigit(c1);
+    return (c2 == '<' || c2 == '>') && has_class(c1, Digit);
 }
 
 // only one of can_*_operator functions that peeks into the future (the `next` parameter)
-static bool can_start_operator(const std::string &current_token, char current, char next) {
-    return utils::strchr_no_null("&<>;|()\n", current) != nullptr ||
+static bool can_start_operator(std::string_view current_token, char current, char next) {
+    return has_class(current, OperatorStart) ||
         (current_token.empty() && can_start_redirection_specified_fd(current, next));
 }
 
@@ -33,10 +130,10 @@ static bool can_be_second_char_of_operator(char first, char second) {
 }
 
 static bool can_be_third_char_of_operator(char first, char second, char third) {
-    return utils::no_locale_isdigit(first) && second == '>' && third == '>';
+    return has_class(first, Digit) && second == '>' && third == '>';
 }
 
-static bool can_extend_operator(const std::string &current_token, char with) {
+static bool can_extend_operator(std::string_view current_token, char with) {
     if(current_token.length() == 1)
         return can_be_second_char_of_operator(current_token.at(0), with);
 
@@ -47,43 +144,104 @@ static bool can_extend_operator(const std::string &current_token, char with) {
     return false;
 }
 
-void Tokenizer::delimit(std::vector<Token> &output, std::string &current_token, Token::Type token_type, int position) {
-    if (current_token.length() == 0) {
+// The token being read. It's only a span of the input - its characters are copied only once something
+// in the middle of it has to be left out (a line continuation)
+class Tokenizer::CurrentToken {
+public:
+    // Without `exact`, the token just spans whatever is left out, instead of being copied.
+    // That's for subtokenizing, where the tokens are thrown away
+    CurrentToken(std::string_view input, bool exact)
+        : m_input(input)
+        , m_exact(exact)
+    {}
+
+    bool empty() const { return m_length == 0; }
+    size_t start() const { return m_start; }
+
+    std::string_view view() const {
+        return m_rewritten ? std::string_view(*m_rewritten) : m_input.substr(m_start, m_length);
+    }
+
+    // Adds `length` characters of the input at `position` to the end of the token
+    void append(size_t position, size_t length = 1) {
+        if(m_length == 0) {
+            m_start = position;
+        } else if(!m_rewritten && m_start + m_length != position) {
+            if(m_exact)
+                m_rewritten = std::make_shared<std::string>(view());
+            else
+                m_length = position - m_start;
+        }
+
+        if(m_rewritten)
+            m_rewritten->append(m_input.substr(position, length));
+        m_length += length;
+    }
+
+    // Moves the value into `token`, leaving this empty
+    void take_into(Token &token) {
+        token.value = view();
+        token.rewritten = std::move(m_rewritten);
+        m_rewritten = nullptr;
+        m_length = 0;
+    }
+
+private:
+    std::string_view m_input;
+    bool m_exact;
+    size_t m_start = 0;
+    size_t m_length = 0;
+    std::shared_ptr<std::string> m_rewritten;
+};
+
+void Tokenizer::delimit(std::vector<Token> &output, CurrentToken &current_token, Token::Type token_type, int position) {
+    if (current_token.empty()) {
         return;
     }
-    int start = position - current_token.size();
+    int start = current_token.start();
     int end = position;
 
-    // TODO: this could propably be quicker than computing the whole utf-8 length every time
-    int untilTokenCodepointLen = utils::utf8_codepoint_len(input, start);
-    int tokenCodepointLen = utils::utf8_codepoint_len(current_token);
-
-    int utf8CodepointStart = untilTokenCodepointLen;
-    int utf8CodepointEnd = untilTokenCodepointLen + tokenCodepointLen;
+    int utf8CodepointStart = codepoints_before + utils::utf8_codepoint_len(input.substr(codepoints_counted_until, start - codepoints_counted_until));
+    int utf8CodepointEnd = utf8CodepointStart + utils::utf8_codepoint_len(input.substr(start, end - start));
+    codepoints_counted_until = end;
+    codepoints_before = utf8CodepointEnd;
 
-    output.push_back(Token {
+    Token &token = output.emplace_back(Token {
                          token_type,
-                         current_token,
+                         {},
+                         nullptr,
                          start,
                          end,
                          utf8CodepointStart,
                          utf8CodepointEnd
                      });
-    current_token.clear();
+    current_token.take_into(token);
 }
 
 std::vector<Token> Tokenizer::tokenize(const Tokenizer::Options &opt) {
     std::vector<Token> output;
+    // Scripts have a token every few bytes - growing the vector there one reallocation at a time is slower
+    // than the scanning itself. What isn't used of this is never touched
+    if(opt.delimit)
+        output.reserve(input.size() / 6);
 
     bool quoted_single = false;
     bool quoted_double = false;
     bool in_operator = false;
 
-    std::string current_token;
+    CurrentToken current_token(input, opt.delimit);
 
     // Count `(`s in `$( (cmd) )`
     int openParensCount = 0;
 
+    // Adds the character at input_i to the word, along with the plain ones following it - which can't end it
+    char until = opt.until.value_or('\n');
+    auto append_word_characters = [&] {
+        size_t run_end = skip_word_characters(input, input_i + 1, until);
+        current_token.append(input_i, run_end - input_i);
+        input_i = run_end - 1;
+    };
+
     for(; input_i < input.length(); input_i++) {
         char ch = input[input_i];
         char next = input_i + 1 < input.length() ? input[input_i + 1] : '\0';
@@ -98,7 +256,7 @@ std::vector<Token> Tokenizer::tokenize(const Tokenizer::Options &opt) {
         if(!quoted_double && !quoted_single && opt.until.has_value() && ch == opt.until.value()) {
             if(openParensCount == 0) {
                 if(opt.delimit)
-                    delimit(output, current_token, Token::Type::WORD, input_i);
+                    delimit(output, current_token, in_operator ? Token::Type::OPERATOR : Token::Type::WORD, input_i);
 
                 return output;
             }
@@ -109,13 +267,13 @@ std::vector<Token> Tokenizer::tokenize(const Tokenizer::Options &opt) {
 
 
         // IEEE Std 1003.1-2017 Shell Command Language 2.3.2
-        if (in_operator && !quoted_single && !quoted_double && can_extend_operator(current_token, ch)) {
-            current_token.push_back(ch);
+        if (in_operator && !quoted_single && !quoted_double && can_extend_operator(current_token.view(), ch)) {
+            current_token.append(input_i);
             continue;
         }
 
         // 2.3.3
-        if (in_operator && !can_extend_operator(current_token, ch)) {
+        if (in_operator && !can_extend_operator(current_token.view(), ch)) {
             if(opt.delimit)
                 delimit(output, current_token, Token::Type::OPERATOR, input_i);
 
@@ -125,38 +283,44 @@ std::vector<Token> Tokenizer::tokenize(const Tokenizer::Options &opt) {
 
         // 2.3.4
         if (!quoted_single && ch == '\\') {
-            current_token.push_back(ch);
-
             if (input_i + 1 == input.length() && throwOnIncompleteInput) {
                 throw SyntaxError{"Tokenizer error: Nothing after a backslash"};
             }
             // TODO: continue if can get more input
+
+            // A line continuation: both the backslash and the newline are left out
+            if (input_i + 1 < input.length() && input[input_i + 1] == '\n') {
+                input_i += 1;
+                continue;
+            }
+
+            current_token.append(input_i, std::min<size_t>(2, input.length() - input_i));
             input_i += 1;
-            if(input[input_i] != '\n')
-                current_token.push_back(input[input_i]);
             continue;
         }
 
         if (!quoted_single && !quoted_double && ch == '"') {
-            current_token.push_back(ch);
+            current_token.append(input_i);
             quoted_double = true;
             continue;
         }
 
         if (!quoted_single && !quoted_double && ch == '\'') {
-            current_token.push_back(ch);
+            current_token.append(input_i);
             quoted_single = true;
             continue;
         }
 
         if (quoted_single && ch != '\'') {
-            current_token.push_back(ch);
+            size_t run_end = skip_single_quoted_characters(input, input_i + 1);
+            current_token.append(input_i, run_end - input_i);
+            input_i = run_end - 1;
             continue;
         }
 
         if (quoted_single && ch == '\'') {
             quoted_single = false;
-            current_token.push_back(ch);
+            current_token.append(input_i);
             continue;
         }
 
@@ -192,56 +356,59 @@ std::vector<Token> Tokenizer::tokenize(const Tokenizer::Options &opt) {
             //
 
             size_t subtokenized_len = input_i - index_before_subtokenization + 1; // `+ 1` because of ')' or '}'
-            current_token.append(input.substr(index_before_subtokenization, subtokenized_len));
+            current_token.append(index_before_subtokenization, subtokenized_len);
             continue;
         }
         // TODO: ``
 
 
         if (quoted_double && ch != '\"') {
-            current_token.push_back(ch);
+            size_t run_end = skip_double_quoted_characters(input, input_i + 1);
+            current_token.append(input_i, run_end - input_i);
+            input_i = run_end - 1;
             continue;
         }
 
         if (quoted_double && ch == '\"') {
             quoted_double = false;
-            current_token.push_back(ch);
+            current_token.append(input_i);
             continue;
         }
 
 
         // 2.3.6
-        if (!quoted_single && !quoted_double && can_start_operator(current_token, ch, next)) {
+        if (!quoted_single && !quoted_double && can_start_operator(current_token.view(), ch, next)) {
             if(opt.delimit)
                 delimit(output, current_token, Token::Type::WORD, input_i);
             in_operator = true;
-            current_token.push_back(ch);
+            current_token.append(input_i);
             continue;
         }
 
         // 2.3.7
-        if (utils::strchr_no_null(" \t\r", ch) != nullptr) {
+        if (has_class(ch, Blank)) {
             if(opt.delimit)
                 delimit(output, current_token, Token::Type::WORD, input_i);
             continue;
         }
 
         // 2.3.8
-        if (current_token.length() != 0) {
-            current_token.push_back(ch);
+        if (!current_token.empty()) {
+            append_word_characters();
             continue;
         }
 
         // 2.3.9
         if (opt.handleComments && ch == '#') {
-            while (input_i < input.length() && input[input_i] != '\n')
+            // Stop right before the newline, so that it still ends the command
+            while (input_i + 1 < input.length() && input[input_i + 1] != '\n')
                 ++input_i;
             continue;
         }
 
         // 2.3.10
-        if (current_token.length() == 0) {
-            current_token.push_back(ch);
+        if (current_token.empty()) {
+            append_word_characters();
             continue;
         }
     }
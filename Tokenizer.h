@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 
@@ -42,6 +43,7 @@ public:
         std::string explanation;
     };
 
+    // The values of the tokens point into the input, so it has to outlive them
     std::vector<Token> tokenize(const Options &opt = Options());
     size_t consumedChars();
 
@@ -51,8 +53,14 @@ private:
     std::string_view input;
     size_t input_i = 0;
 
+    // How many utf-8 codepoints there are before input[codepoints_counted_until].
+    // Tokens are delimited in order, so each one only has to count from where the previous one ended
+    size_t codepoints_counted_until = 0;
+    int codepoints_before = 0;
+
     // set to none when tokenizing input on <tab> presses
     bool throwOnIncompleteInput = true;
 
-    void delimit(std::vector<Token> &output, std::string &current_token, Token::Type token_type, int position);
+    class CurrentToken;
+    void delimit(std::vector<Token> &output, CurrentToken &current_token, Token::Type token_type, int position);
 };
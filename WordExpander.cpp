@@ -1,6 +1,7 @@
 #include "WordExpander.h"
 #include <ctype.h>
 #include <string>
+#include <array>
 #include <string.h>
 #include "Global.h"
 #include "Tokenizer.h"
@@ -10,6 +11,7 @@
 #include <errno.h>
 #include "utils.h"
 #include <glob.h>
+#include <algorithm>
 
 
 static bool is_one_letter_variable_name(char ch) {
@@ -24,10 +26,110 @@ static bool can_be_in_variable_name(char ch) {
     return utils::no_locale_isalnum(ch) || ch == '_';
 }
 
+CompiledWord WordExpander::compile(std::string_view input)
+{
+    using Part = CompiledWord::Part;
+    CompiledWord word;
+
+    auto add_literal = [&](std::string_view text, bool quoted) {
+        if(!word.parts.empty() && word.parts.back().type == Part::Literal && word.parts.back().quoted == quoted) {
+            word.parts.back().text.append(text);
+        } else {
+            word.parts.push_back({Part::Literal, quoted, std::string(text)});
+        }
+    };
+
+    // The same walk over the word as expand_into() does, just recording what to expand instead of expanding it
+    enum { FREE, SINGLE_QUOTED, DOUBLE_QUOTED } state = FREE;
+
+    for(size_t i = 0; i < input.size(); i++) {
+        char ch = input[i];
+        bool has_next_ch = i != input.size() - 1;
+        char next_ch = has_next_ch ? input[i + 1] : '\0';
+
+        if(state == FREE && (ch == '"' || ch == '\'')) {
+            state = ch == '"' ? DOUBLE_QUOTED : SINGLE_QUOTED;
+            word.parts.push_back({Part::Quotes});
+        } else if(state == DOUBLE_QUOTED && ch == '"') {
+            state = FREE;
+        } else if(state == SINGLE_QUOTED && ch == '\'') {
+            state = FREE;
+        } else if(state != SINGLE_QUOTED && ch == '\\') {
+            if(has_next_ch)
+                add_literal(std::string_view(&input[i + 1], 1), true);
+            i += 1;
+        } else if(state != SINGLE_QUOTED && ch == '$' && has_next_ch && is_one_letter_variable_name(next_ch)) {
+            word.parts.push_back({Part::Parameter, state == DOUBLE_QUOTED, std::string(1, next_ch)});
+            i += 1;
+        } else if(state != SINGLE_QUOTED && ch == '$' && can_start_variable_name(next_ch)) {
+            size_t variable_name_end = i + 1;
+            while(variable_name_end < input.size() && can_be_in_variable_name(input[variable_name_end])) {
+                variable_name_end++;
+            }
+            word.parts.push_back({Part::Parameter, state == DOUBLE_QUOTED, std::string(input.substr(i + 1, variable_name_end - i - 1))});
+            i = variable_name_end - 1;
+        } else if(state != SINGLE_QUOTED && ch == '$' && next_ch == '(') {
+            // Parsed right away, into a tree of its own: the tokens it's parsed from don't outlive this function,
+            // but the tree only keeps pointers to them for syntax highlighting
+            Tokenizer::Options opt;
+            opt.countToUntil = '(';
+            opt.until = ')';
+            Tokenizer tokenizer(input.substr(i + 2));
+            auto commands = std::make_shared<OwnedCommandList>();
+            try {
+                std::vector<Token> tokens = tokenizer.tokenize(opt);
+                commands->commands = Parser(tokens, &commands->arena).parse();
+            } catch(const Tokenizer::SyntaxError &) {
+                // Leave reporting the error to when (and if) the word is expanded
+                return {};
+            } catch(const Parser::SyntaxError &) {
+                return {};
+            }
+            word.parts.push_back({Part::CommandSubstitution, state == DOUBLE_QUOTED, {}, std::move(commands)});
+            word.has_command_substitution = true;
+            i = i + 2 + tokenizer.consumedChars();
+        } else if(state == FREE && ch == '~' && (i == 0 || input[i - 1] == ':')) {
+            size_t username_end = i + 1;
+            while(username_end < input.size() && (utils::no_locale_isalnum(input[username_end]) || strchr("._-", input[username_end]) != nullptr)) {
+                username_end++;
+            }
+            word.parts.push_back({Part::Tilde, false, std::string(input.substr(i + 1, username_end - i - 1))});
+            i = username_end - 1;
+        } else {
+            add_literal(std::string_view(&input[i], 1), state != FREE);
+        }
+    }
+
+    word.compiled = true;
+    word.is_literal = std::all_of(word.parts.begin(), word.parts.end(), [](const Part &part) {
+        if(part.type == Part::Quotes)
+            return true;
+        return part.type == Part::Literal && (part.quoted || part.text.find_first_of(" \t\n*?") == std::string::npos);
+    });
+    if(word.is_literal) {
+        for(const Part &part : word.parts)
+            word.literal.append(part.text);
+    }
+
+    return word;
+}
+
 bool WordExpander::expand_into(std::vector<std::string> &buf)
 {
     out = &buf;
 
+    bool use_compiled = compiled && compiled->compiled && (opt.unsafeExpansions || !compiled->has_command_substitution);
+
+    if(use_compiled && compiled->is_literal) {
+        // Nothing to expand or split: `word`, `'two words'`, `""`
+        bool has_quotes = std::any_of(compiled->parts.begin(), compiled->parts.end(), [](const CompiledWord::Part &part) {
+            return part.type == CompiledWord::Part::Quotes;
+        });
+        if(!compiled->literal.empty() || has_quotes)
+            out->push_back(compiled->literal);
+        return true;
+    }
+
     can_expand_to_empty_word = true;
 
     // Assume we can't expand to an empty word (for example, the word contains quotations
@@ -35,6 +137,72 @@ bool WordExpander::expand_into(std::vector<std::string> &buf)
     // anything, pop that empty string back at the end of this function
     out->emplace_back();
 
+    if(use_compiled) {
+        expand_compiled_parts();
+    } else {
+        expand_text();
+    }
+
+    do_pathname_expansion_on_last_word();
+
+    // Note that word expansion might result in multiple words - out->back() being empty
+    // does not necessarily mean the expansion did not expand to anything
+    // For example:
+    //     set -- 1 2 ''; echo "$@"
+    // However, this only matters in situations where quotes are used - so can_expand_to_empty_word is false.
+    // That's why it's not necessary to check if out->size() has changed due to expansion to multiple words.
+    if(can_expand_to_empty_word && out->back().empty()) {
+        out->pop_back();
+    }
+
+    return true;
+}
+
+void WordExpander::expand_compiled_parts()
+{
+    using Part = CompiledWord::Part;
+
+    for(const Part &part : compiled->parts) {
+        switch(part.type) {
+        case Part::Literal:
+            if(part.quoted)
+                out->back().append(part.text);
+            else
+                add_string_unquoted(part.text);
+            break;
+        case Part::Parameter:
+            if(part.text == "@" && part.quoted) {
+                expand_special_variable_double_quoted('@');
+            } else if(part.text == "@") {
+                expand_special_variable_free('@');
+            } else if(std::optional<std::string> value = g.get_variable(part.text)) {
+                if(part.quoted)
+                    out->back().append(value.value());
+                else
+                    add_string_unquoted(value.value());
+            }
+            break;
+        case Part::CommandSubstitution:
+            if(part.quoted) {
+                executor::subshell_capture_output(part.commands->commands, out->back());
+            } else {
+                std::string output;
+                executor::subshell_capture_output(part.commands->commands, output);
+                add_string_unquoted(output);
+            }
+            break;
+        case Part::Tilde:
+            expand_tilda_username(part.text);
+            break;
+        case Part::Quotes:
+            can_expand_to_empty_word = false;
+            break;
+        }
+    }
+}
+
+void WordExpander::expand_text()
+{
     enum { FREE, SINGLE_QUOTED, DOUBLE_QUOTED } state = FREE;
 
     for(size_t i = 0; i < input.size(); i++) {
@@ -84,20 +252,6 @@ bool WordExpander::expand_into(std::vector<std::string> &buf)
             add_character_literal(ch);
         }
     }
-
-    do_pathname_expansion_on_last_word();
-
-    // Note that word expansion might result in multiple words - out->back() being empty
-    // does not necessarily mean the expansion did not expand to anything
-    // For example:
-    //     set -- 1 2 ''; echo "$@"
-    // However, this only matters in situations where quotes are used - so can_expand_to_empty_word is false.
-    // That's why it's not necessary to check if out->size() has changed due to expansion to multiple words.
-    if(can_expand_to_empty_word && out->back().empty()) {
-        out->pop_back();
-    }
-
-    return true;
 }
 
 bool WordExpander::expand_into(std::string &buf)
@@ -115,7 +269,7 @@ bool WordExpander::expand_into(std::string &buf)
         return true;
     }
 
-    buf = buf_vec.at(0);
+    buf = std::move(buf_vec.at(0));
     return true;
 }
 
@@ -156,6 +310,29 @@ void WordExpander::add_character_quoted(char ch)
     out->back().push_back(ch);
 }
 
+// Same as calling add_character_unquoted() on every character, but appends
+// the runs between field separators and pattern characters all at once
+void WordExpander::add_string_unquoted(std::string_view str)
+{
+    static constexpr auto is_special = [] {
+        std::array<bool, 256> table {};
+        for(unsigned char ch : std::string_view(" \t\n*?"))
+            table[ch] = true;
+        return table;
+    }();
+
+    size_t run_begin = 0;
+    for(size_t i = 0; i < str.size(); i++) {
+        if(!is_special[static_cast<unsigned char>(str[i])])
+            continue;
+
+        out->back().append(str.substr(run_begin, i - run_begin));
+        add_character_unquoted(str[i]);
+        run_begin = i + 1;
+    }
+    out->back().append(str.substr(run_begin));
+}
+
 void WordExpander::mark_pathname_expansion_character_location()
 {
     size_t current_location = out->back().size() - 1;
@@ -222,7 +399,14 @@ size_t WordExpander::expand_tilda(size_t username_begin)
         username_end++;
     }
 
-    std::string username = std::string(input.substr(username_begin, username_end - username_begin));
+    expand_tilda_username(input.substr(username_begin, username_end - username_begin));
+
+    return username_end - 1;
+}
+
+void WordExpander::expand_tilda_username(std::string_view username_view)
+{
+    std::string username = std::string(username_view);
 
     std::string_view expanded;
     passwd *pw;
@@ -233,8 +417,9 @@ size_t WordExpander::expand_tilda(size_t username_begin)
         HOME = g.get_variable("HOME");
 
         // If $HOME somehow isn't set, put back a tilde
-        static const char* static_tilde = "~";
-        expanded = HOME.value_or(static_tilde);
+        if(!HOME)
+            HOME = "~";
+        expanded = HOME.value();
     } else {
         // Expanding the longer "~user"
 
@@ -253,7 +438,8 @@ size_t WordExpander::expand_tilda(size_t username_begin)
             }
 
             // No matching username found: Put the original "~user" expression back as an expanded expression
-            expanded = input.substr(username_begin - 1, username_end - username_begin + 1);
+            username.insert(0, 1, '~');
+            expanded = username;
         } else {
             // Successfully got the home directory of ~user
             expanded = pw->pw_dir;
@@ -261,8 +447,6 @@ size_t WordExpander::expand_tilda(size_t username_begin)
     }
 
     out->back().append(expanded);
-
-    return username_end - 1;
 }
 
 size_t WordExpander::expand_command_substitution_free(size_t input_position)
@@ -276,9 +460,7 @@ size_t WordExpander::expand_command_substitution_free(size_t input_position)
     std::string output;
     executor::subshell_capture_output(tokens, output);
 
-    for(char ch : output) {
-        add_character_unquoted(ch);
-    }
+    add_string_unquoted(output);
 
     return input_position + tokenizer.consumedChars();
 }
@@ -305,9 +487,7 @@ void WordExpander::expand_special_variable_free(char varname)
     }
 
     if(std::optional<std::string> var_value = g.get_variable(std::string(1, varname))) {
-        for(char ch : var_value.value()) {
-            add_character_unquoted(ch);
-        }
+        add_string_unquoted(var_value.value());
     }
 }
 
@@ -343,9 +523,7 @@ size_t WordExpander::expand_variable_free(size_t variable_name_begin)
     std::string variable_name = std::string(input.substr(variable_name_begin, variable_name_end - variable_name_begin));
 
     if(std::optional<std::string> variable_value = g.get_variable(variable_name)) {
-        for(char ch : variable_value.value()) {
-            add_character_unquoted(ch);
-        }
+        add_string_unquoted(variable_value.value());
     }
 
     return variable_name_end - 1;
@@ -38,6 +38,16 @@ public:
         , input(input)
     { }
 
+    // Expands a word that was compiled by the parser, falling back to its text if it couldn't be compiled
+    explicit WordExpander(const Options &opt, const CompiledWord &compiled, std::string_view input)
+        : opt(opt)
+        , input(input)
+        , compiled(&compiled)
+    { }
+
+    // Splits a word into the parts that are expanded at runtime - see CompiledWord
+    static CompiledWord compile(std::string_view word);
+
     bool expand_into(std::vector<std::string> &buf);
 
     // Expands into a single string
@@ -47,12 +57,14 @@ public:
 private:
     Options opt;
     std::string_view input;
+    const CompiledWord *compiled = nullptr;
     std::vector<std::string> *out;
     std::vector<size_t> pathname_expansion_pattern_location_on_last_word;
 
     void add_character_literal(char ch);
     void add_character_unquoted(char ch);
     void add_character_quoted(char ch);
+    void add_string_unquoted(std::string_view str);
 
     void mark_pathname_expansion_character_location();
 
@@ -61,7 +73,11 @@ private:
 
     void do_pathname_expansion_on_last_word();
 
+    void expand_text();
+    void expand_compiled_parts();
+
     size_t expand_tilda(size_t input_position);
+    void expand_tilda_username(std::string_view username);
     size_t expand_command_substitution_free(size_t input_position);
     size_t expand_command_substitution_double_quoted(size_t input_position);
     void expand_special_variable_free(char varname);
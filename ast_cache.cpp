@@ -0,0 +1,504 @@
+#include "ast_cache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <variant>
+#include "Global.h"
+#include "utils.h"
+
+namespace ast_cache {
+
+namespace {
+
+// Bump whenever the layout below or the parse tree in Parser.h changes - entries of other versions are ignored
+constexpr std::uint32_t format_version = 1;
+constexpr std::string_view magic { "kishast\0", 8 };
+
+// FNV-1a
+std::uint64_t hash(std::string_view data) {
+    std::uint64_t h = 0xcbf29ce484222325;
+    for(char c : data) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+std::optional<std::string> cache_directory() {
+    std::optional<std::string> xdg_cache_home = g.get_variable("XDG_CACHE_HOME");
+    if(xdg_cache_home && xdg_cache_home->starts_with('/'))
+        return *xdg_cache_home + "/kish";
+
+    std::optional<std::string> home = g.get_variable("HOME");
+    if(home && !home->empty())
+        return *home + "/.cache/kish";
+
+    return std::nullopt;
+}
+
+std::optional<std::string> entry_path(const Key &key) {
+    std::optional<std::string> directory = cache_directory();
+    if(!directory)
+        return std::nullopt;
+
+    char name[32];
+    snprintf(name, sizeof name, "/%016llx.ast", static_cast<unsigned long long>(hash(key.path)));
+    return *directory + name;
+}
+
+// `mkdir -p`
+bool make_directories(const std::string &path) {
+    for(std::size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0700);
+
+    return mkdir(path.c_str(), 0700) == 0 || errno == EEXIST;
+}
+
+// While it exists, allocations of the parse tree's containers go to `arena` - like they do in a Parser
+class DefaultResourceScope {
+public:
+    explicit DefaultResourceScope(std::pmr::memory_resource *arena)
+        : m_previous(std::pmr::set_default_resource(arena))
+    {}
+    ~DefaultResourceScope() { std::pmr::set_default_resource(m_previous); }
+
+    DefaultResourceScope(const DefaultResourceScope &) = delete;
+    DefaultResourceScope &operator=(const DefaultResourceScope &) = delete;
+private:
+    std::pmr::memory_resource *m_previous;
+};
+
+// Integers are stored as they are in memory - entries are never shared between machines
+class Encoder {
+public:
+    explicit Encoder(std::string &out)
+        : m_out(out)
+    {}
+
+    template <typename T>
+    void integer(T value) {
+        m_out.append(reinterpret_cast<const char *>(&value), sizeof value);
+    }
+
+    void count(std::size_t n) { integer(static_cast<std::uint32_t>(n)); }
+    void flag(bool value) { integer(static_cast<std::uint8_t>(value)); }
+
+    void string(std::string_view s) {
+        count(s.size());
+        m_out.append(s);
+    }
+
+    void key(const Key &key) {
+        string(key.path);
+        integer(key.size);
+        integer(key.mtime_sec);
+        integer(key.mtime_nsec);
+        integer(key.content_hash);
+    }
+
+    void command_list(const CommandList &command_list) {
+        count(command_list.size());
+        for(const WithFollowingOperator<AndOrList> &aol_op : command_list) {
+            count(aol_op.val.size());
+            for(const WithFollowingOperator<Pipeline> &pipe_op : aol_op.val) {
+                count(pipe_op.val.commands.size());
+                for(const Command &cmd : pipe_op.val.commands)
+                    command(cmd);
+                flag(pipe_op.val.negation_prefix);
+                string(pipe_op.following_operator);
+            }
+            string(aol_op.following_operator);
+        }
+    }
+
+private:
+    std::string &m_out;
+
+    void word(const CompiledWord &word) {
+        flag(word.compiled);
+        flag(word.is_literal);
+        flag(word.has_command_substitution);
+        string(word.literal);
+
+        count(word.parts.size());
+        for(const CompiledWord::Part &part : word.parts) {
+            integer(static_cast<std::uint8_t>(part.type));
+            flag(part.quoted);
+            string(part.text);
+            flag(part.commands != nullptr);
+            if(part.commands)
+                command_list(part.commands->commands);
+        }
+    }
+
+    void words(const std::pmr::vector<CompiledWord> &words) {
+        count(words.size());
+        for(const CompiledWord &w : words)
+            word(w);
+    }
+
+    void strings(const std::vector<std::string> &strings) {
+        count(strings.size());
+        for(const std::string &s : strings)
+            string(s);
+    }
+
+    void command(const Command &cmd) {
+        count(cmd.redirections.size());
+        for(const Redirection &redirection : cmd.redirections) {
+            integer(static_cast<std::uint8_t>(redirection.type));
+            integer(static_cast<std::int32_t>(redirection.fd));
+            integer(static_cast<std::int32_t>(redirection.rewire_fd));
+            string(redirection.path);
+            word(redirection.compiled_path);
+        }
+
+        integer(static_cast<std::uint8_t>(cmd.value.index()));
+        std::visit(utils::overloaded {
+            [&] (const Command::Empty &) { },
+            [&] (const Command::Simple &simple) {
+                count(simple.variable_assignments.size());
+                for(const Command::Simple::VariableAssignment &assignment : simple.variable_assignments) {
+                    string(assignment.name);
+                    string(assignment.value);
+                    word(assignment.compiled_value);
+                }
+                strings(simple.argv);
+                words(simple.compiled_argv);
+            },
+            [&] (const Command::BraceGroup &brace_group) { command_list(brace_group.command_list); },
+            [&] (const Command::If &if_command) {
+                command_list(if_command.condition);
+                command_list(if_command.then);
+                count(if_command.elif.size());
+                for(const Command::If::Elif &elif : if_command.elif) {
+                    command_list(elif.condition);
+                    command_list(elif.then);
+                }
+                flag(if_command.opt_else.has_value());
+                if(if_command.opt_else)
+                    command_list(*if_command.opt_else);
+            },
+            [&] (const Command::While &while_command) {
+                command_list(while_command.condition);
+                command_list(while_command.body);
+            },
+            [&] (const Command::Until &until_command) {
+                command_list(until_command.condition);
+                command_list(until_command.body);
+            },
+            [&] (const Command::For &for_command) {
+                string(for_command.varname);
+                strings(for_command.items);
+                words(for_command.compiled_items);
+                command_list(for_command.body);
+            },
+            [&] (const Command::FunctionDefinition &function) {
+                string(function.name);
+                flag(function.body != nullptr);
+                if(function.body)
+                    command_list(*function.body);
+            },
+        }, cmd.value);
+    }
+};
+
+// The reverse of Encoder. Containers are allocated from the current default memory resource
+class Decoder {
+public:
+    Decoder(std::string_view in, std::size_t &pos)
+        : m_in(in)
+        , m_pos(pos)
+    {}
+
+    template <typename T>
+    T integer() {
+        T value;
+        memcpy(&value, take(sizeof value), sizeof value);
+        return value;
+    }
+
+    // Every element takes at least a byte, so a damaged count can't make a huge reservation
+    std::size_t count() {
+        std::size_t n = integer<std::uint32_t>();
+        if(n > m_in.size() - m_pos)
+            throw Reader::Damaged{};
+        return n;
+    }
+    bool flag() { return integer<std::uint8_t>() != 0; }
+
+    // Reads a count and makes room for that many elements
+    template <typename Container>
+    std::size_t reserve(Container &container) {
+        std::size_t n = count();
+        container.reserve(n);
+        return n;
+    }
+
+    std::string string() {
+        std::size_t size = count();
+        return std::string(take(size), size);
+    }
+
+    Key key() {
+        Key key;
+        key.path = string();
+        key.size = integer<std::uint64_t>();
+        key.mtime_sec = integer<std::int64_t>();
+        key.mtime_nsec = integer<std::int64_t>();
+        key.content_hash = integer<std::uint64_t>();
+        return key;
+    }
+
+    void command_list(CommandList &command_list) {
+        for(std::size_t aol_count = reserve(command_list); aol_count > 0; aol_count--) {
+            WithFollowingOperator<AndOrList> &aol_op = command_list.emplace_back();
+            for(std::size_t pipeline_count = reserve(aol_op.val); pipeline_count > 0; pipeline_count--) {
+                WithFollowingOperator<Pipeline> &pipe_op = aol_op.val.emplace_back();
+                for(std::size_t command_count = reserve(pipe_op.val.commands); command_count > 0; command_count--)
+                    command(pipe_op.val.commands.emplace_back());
+                pipe_op.val.negation_prefix = flag();
+                pipe_op.following_operator = string();
+            }
+            aol_op.following_operator = string();
+        }
+    }
+
+private:
+    std::string_view m_in;
+    std::size_t &m_pos;
+
+    const char *take(std::size_t size) {
+        if(size > m_in.size() - m_pos)
+            throw Reader::Damaged{};
+        const char *taken = m_in.data() + m_pos;
+        m_pos += size;
+        return taken;
+    }
+
+    template <typename Enum>
+    Enum enumerator(Enum last) {
+        std::uint8_t value = integer<std::uint8_t>();
+        if(value > last)
+            throw Reader::Damaged{};
+        return static_cast<Enum>(value);
+    }
+
+    // Function bodies and command substitutions have arenas of their own, see OwnedCommandList
+    std::shared_ptr<OwnedCommandList> owned_command_list() {
+        auto owned = std::make_shared<OwnedCommandList>();
+        DefaultResourceScope scope(&owned->arena);
+        command_list(owned->commands);
+        return owned;
+    }
+
+    void word(CompiledWord &word) {
+        word.compiled = flag();
+        word.is_literal = flag();
+        word.has_command_substitution = flag();
+        word.literal = string();
+
+        for(std::size_t part_count = reserve(word.parts); part_count > 0; part_count--) {
+            CompiledWord::Part &part = word.parts.emplace_back();
+            part.type = enumerator(CompiledWord::Part::Quotes);
+            part.quoted = flag();
+            part.text = string();
+            if(flag())
+                part.commands = owned_command_list();
+        }
+    }
+
+    void words(std::pmr::vector<CompiledWord> &words) {
+        for(std::size_t word_count = reserve(words); word_count > 0; word_count--)
+            word(words.emplace_back());
+    }
+
+    void strings(std::vector<std::string> &strings) {
+        for(std::size_t string_count = reserve(strings); string_count > 0; string_count--)
+            strings.push_back(string());
+    }
+
+    void command(Command &cmd) {
+        for(std::size_t redirection_count = reserve(cmd.redirections); redirection_count > 0; redirection_count--) {
+            Redirection &redirection = cmd.redirections.emplace_back();
+            redirection.type = enumerator(Redirection::Rewiring);
+            redirection.fd = integer<std::int32_t>();
+            redirection.rewire_fd = integer<std::int32_t>();
+            redirection.path = string();
+            word(redirection.compiled_path);
+        }
+
+        switch(integer<std::uint8_t>()) {
+        case 0:
+            break;
+        case 1: {
+            Command::Simple &simple = cmd.value.emplace<Command::Simple>();
+            for(std::size_t assignment_count = reserve(simple.variable_assignments); assignment_count > 0; assignment_count--) {
+                Command::Simple::VariableAssignment &assignment = simple.variable_assignments.emplace_back();
+                assignment.name = string();
+                assignment.value = string();
+                word(assignment.compiled_value);
+            }
+            strings(simple.argv);
+            words(simple.compiled_argv);
+            break;
+        }
+        case 2:
+            command_list(cmd.value.emplace<Command::BraceGroup>().command_list);
+            break;
+        case 3: {
+            Command::If &if_command = cmd.value.emplace<Command::If>();
+            command_list(if_command.condition);
+            command_list(if_command.then);
+            for(std::size_t elif_count = reserve(if_command.elif); elif_count > 0; elif_count--) {
+                Command::If::Elif &elif = if_command.elif.emplace_back();
+                command_list(elif.condition);
+                command_list(elif.then);
+            }
+            if(flag())
+                command_list(if_command.opt_else.emplace());
+            break;
+        }
+        case 4: {
+            Command::While &while_command = cmd.value.emplace<Command::While>();
+            command_list(while_command.condition);
+            command_list(while_command.body);
+            break;
+        }
+        case 5: {
+            Command::Until &until_command = cmd.value.emplace<Command::Until>();
+            command_list(until_command.condition);
+            command_list(until_command.body);
+            break;
+        }
+        case 6: {
+            Command::For &for_command = cmd.value.emplace<Command::For>();
+            for_command.varname = string();
+            strings(for_command.items);
+            words(for_command.compiled_items);
+            command_list(for_command.body);
+            break;
+        }
+        case 7: {
+            Command::FunctionDefinition &function = cmd.value.emplace<Command::FunctionDefinition>();
+            function.name = string();
+            if(flag()) {
+                std::shared_ptr<OwnedCommandList> body = owned_command_list();
+                function.body = std::shared_ptr<const CommandList>(body, &body->commands);
+            }
+            break;
+        }
+        default:
+            throw Reader::Damaged{};
+        }
+    }
+};
+
+bool same_key(const Key &a, const Key &b) {
+    return a.path == b.path && a.size == b.size && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec
+        && a.content_hash == b.content_hash;
+}
+
+} // namespace
+
+std::optional<Key> key_for(const std::string &path, const struct stat &st, std::string_view contents) {
+    char absolute_path[PATH_MAX];
+    if(realpath(path.c_str(), absolute_path) == nullptr)
+        return std::nullopt;
+
+    Key key;
+    key.path = absolute_path;
+    key.size = static_cast<std::uint64_t>(st.st_size);
+    key.mtime_sec = st.st_mtim.tv_sec;
+    key.mtime_nsec = st.st_mtim.tv_nsec;
+    key.content_hash = hash(contents);
+    return key;
+}
+
+Reader::Reader(const Key &key) {
+    std::optional<std::string> path = entry_path(key);
+    if(!path)
+        return;
+
+    int fd = open(path->c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return;
+    bool read_ok = utils::read_whole_file(fd, m_data);
+    close(fd);
+    if(!read_ok || !m_data.starts_with(magic))
+        return;
+
+    try {
+        m_pos = magic.size();
+        Decoder header(m_data, m_pos);
+        if(header.integer<std::uint32_t>() != format_version || !same_key(header.key(), key))
+            return;
+
+        std::uint64_t payload_hash = header.integer<std::uint64_t>();
+        if(payload_hash != hash(std::string_view(m_data).substr(m_pos)))
+            return;
+    } catch(const Damaged &) {
+        return;
+    }
+
+    m_found = true;
+}
+
+CommandList Reader::next(std::pmr::memory_resource *arena) {
+    DefaultResourceScope scope(arena);
+    CommandList command_list(arena);
+    Decoder(m_data, m_pos).command_list(command_list);
+    return command_list;
+}
+
+Writer::Writer(Key key)
+    : m_key(std::move(key))
+{}
+
+void Writer::add(const CommandList &complete_command) {
+    Encoder(m_payload).command_list(complete_command);
+}
+
+bool Writer::commit() {
+    if(m_committed)
+        return *m_committed;
+    m_committed = false;
+
+    // The script changed while it was being parsed - the commands might not match any version of it
+    struct stat st;
+    if(stat(m_key.path.c_str(), &st) == -1 || static_cast<std::uint64_t>(st.st_size) != m_key.size
+       || st.st_mtim.tv_sec != m_key.mtime_sec || st.st_mtim.tv_nsec != m_key.mtime_nsec)
+        return false;
+
+    std::optional<std::string> path = entry_path(m_key);
+    if(!path || !make_directories(path->substr(0, path->rfind('/'))))
+        return false;
+
+    std::string header(magic);
+    Encoder encoder(header);
+    encoder.integer(format_version);
+    encoder.key(m_key);
+    encoder.integer(hash(m_payload));
+
+    // Written next to the entry and renamed over it, so that a reader never sees half of one
+    std::string temporary_path = *path + ".XXXXXX";
+    int fd = mkstemp(temporary_path.data());
+    if(fd == -1)
+        return false;
+
+    bool written = utils::write_all(fd, header) && utils::write_all(fd, m_payload);
+    written = close(fd) == 0 && written;
+    if(!written || rename(temporary_path.c_str(), path->c_str()) == -1) {
+        unlink(temporary_path.c_str());
+        return false;
+    }
+
+    m_committed = true;
+    return true;
+}
+
+}
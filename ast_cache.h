@@ -0,0 +1,73 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "Parser.h"
+
+// A cache of parsed scripts on disk, so that the large files sourced by every shell
+// (function libraries, ~/.kishrc) don't have to be tokenized and parsed every time.
+// A script is stored as its complete commands (see Parser::parse_complete_command()), in a binary form
+// that's read straight back into a parse tree. Entries live in $XDG_CACHE_HOME/kish (or ~/.cache/kish),
+// one per script path, and only match the exact contents they were parsed from.
+// Filled when a script is run, or ahead of time with `kish --compile`
+namespace ast_cache {
+
+// Smaller scripts are parsed faster than their cache entry is found and checked
+inline constexpr std::size_t min_cached_size = 4 * 1024;
+
+// What a cache entry has to match: the script's absolute path, size, modification time and contents
+struct Key {
+    std::string path;
+    std::uint64_t size = 0;
+    std::int64_t mtime_sec = 0;
+    std::int64_t mtime_nsec = 0;
+    std::uint64_t content_hash = 0;
+};
+
+// `contents` are all of the file described by `st`. nullopt if its absolute path can't be found
+std::optional<Key> key_for(const std::string &path, const struct stat &st, std::string_view contents);
+
+// Reads the complete commands of a cached script back, one at a time
+class Reader {
+public:
+    // Finds the entry for `key`. Stale entries, damaged ones and ones written by other versions of kish are ignored
+    explicit Reader(const Key &key);
+
+    explicit operator bool() const { return m_found; }
+    bool at_end() const { return m_pos == m_data.size(); }
+
+    // The next complete command, allocated from `arena`.
+    // Its tokens (used only for syntax highlighting) aren't stored, so they're all null
+    CommandList next(std::pmr::memory_resource *arena);
+
+    struct Damaged {};
+
+private:
+    bool m_found = false;
+    std::string m_data;
+    std::size_t m_pos = 0;
+};
+
+// Collects the complete commands of a script as it's parsed, to store them as its entry
+class Writer {
+public:
+    explicit Writer(Key key);
+
+    void add(const CommandList &complete_command);
+
+    // Replaces the entry of the script with the commands added so far - unless it has changed since
+    // the key was made. Only does that once, later calls return what the first one did.
+    // The cache is only an optimization, so failing to write it is reported only by the return value
+    bool commit();
+
+private:
+    Key m_key;
+    std::string m_payload;
+    std::optional<bool> m_committed;
+};
+
+}
@@ -0,0 +1,74 @@
+#!/bin/bash
+# Usage: benchmarks.sh <kish> [baseline kish]
+# When a baseline is given (for example a kish built with -DKISH_SPAWN=OFF), every
+# benchmark is run with both shells so that the numbers can be compared
+KISH=${1:-kish}
+BASELINE=$2
+tmpdir=$(mktemp -d -t kish-bench.XXXXXXXXXX)
+trap 'rm -rf "$tmpdir"' EXIT
+
+export LANG=C
+# Parsed scripts are cached here instead of in ~/.cache/kish
+export XDG_CACHE_HOME="$tmpdir/cache"
+
+now_ns() {
+        date +%s%N
+}
+
+# kbench usage:
+#  kbench <name> <how many units does the script do> <unit name> <kish commands>
+kbench() {
+        local shell start end
+        for shell in "$KISH" ${BASELINE:+"$BASELINE"}; do
+                start=$(now_ns)
+                "$shell" -c "$4" > /dev/null
+                end=$(now_ns)
+                awk -v name="$1" -v shell="$shell" -v units="$2" -v unit="$3" -v ns="$((end - start))" 'BEGIN {
+                        printf "%-32s %-24s %12.1f %s/s  (%.3fs)\n", name, shell, units / (ns / 1e9), unit, ns / 1e9
+                }'
+        done
+}
+
+items=$(seq -s ' ' 2000)
+kbench 'external commands' 2000 commands "for i in $items; do /bin/true; done"
+kbench 'external commands with env' 2000 commands "for i in $items; do A=1 /bin/true; done"
+kbench 'external commands redirected' 2000 commands "for i in $items; do /bin/true > /dev/null; done"
+kbench 'test builtin conditions' 2000 conditions "for i in $items; do [ -f /etc/passwd -a -s /etc/passwd ] && [ \$i -lt 5000 ]; done"
+kbench 'command substitutions' 2000 substitutions "for i in $items; do x=\$(/bin/true); done"
+kbench 'builtin command substitutions' 2000 substitutions "f() { printf %s \"[\$1]\"; }; for i in $items; do x=\$(f \$i); done"
+kbench 'function calls' 20000 calls "f() { if true; then :; fi; while false; do :; done; : \$1; }; for i in \$(seq 20000); do f \$i; done"
+kbench 'nested loop bodies' 30000 iterations "for i in \$(seq 3000); do for j in a b c d e f g h i j; do if [ \$j = x ]; then echo \$i; fi; done; done"
+kbench 'word expansion' 50000 commands "for i in \$(seq 50000); do : /usr/share/some/rather/long/path/name.txt 'a single quoted argument that is long' \"prefix-\$i-and-a-long-suffix\" --option-name=some-long-value \"\$i\$i\$i\" ~/x; done"
+kbench 'control flow' 200000 iterations "f() { for i in \$(seq 200000); do if [ \$i = x ]; then :; elif true && false; then :; else x=\$i; fi; while false; do :; done; done; }; f"
+kbench 'control flow (bytecode)' 200000 iterations "set -o bytecode; f() { for i in \$(seq 200000); do if [ \$i = x ]; then :; elif true && false; then :; else x=\$i; fi; while false; do :; done; done; }; f"
+kbench '5-stage pipelines' 500 pipelines "for i in \$(seq 500); do : | : | : | : | :; done"
+kbench 'parallel jobs' 2000 jobs "parallel -j 8 /bin/true ::: $items"
+
+# 16 MiB of short words, captured whole and split into fields
+yes 'lorem ipsum dolor sit amet' | head -c $((16 * 1024 * 1024)) > "$tmpdir/capture"
+# 300 lines of functions, conditionals and loops - only parsed, with `kish -n`
+for i in $(seq 150); do
+        echo "f$i() { if [ \"\$1\" = x$i ]; then echo \"matched \$1\" > /dev/null; elif test -n \"\$2\"; then printf '%s\\n' a b c | grep -v b; else for w in one two three; do x=\$w; done; fi; }"
+        echo "while false; do cmd$i --flag=value arg1 arg2 \"quoted \$var\" | sort -u >> /tmp/out$i; done"
+done > "$tmpdir/script"
+kbench 'parsing a 300-line script' 20 parses "for i in \$(seq 20); do '$KISH' -n '$tmpdir/script'; done"
+# 2000 lines of 12 tokens and a newline each - only tokenized and parsed, with `kish -n`
+for i in $(seq 2000); do
+        echo "cmd$i --flag=some-long-value \"quoted \$var and more\" /usr/local/share/kish/file$i.txt > /dev/null && other | x; y=$i"
+done > "$tmpdir/tokens"
+kbench 'tokenizing a 2000-line script' 26000 tokens "'$KISH' -n '$tmpdir/tokens'"
+# 20000 short commands, run while the script is read
+for i in $(seq 20000); do
+        echo "x=\"value $i\"; : \$x --flag"
+done > "$tmpdir/long"
+kbench 'running a 20000-line script' 20000 lines "'$KISH' '$tmpdir/long'"
+# A 5 MB library of one-line functions, sourced before the first call
+for i in $(seq 62000); do
+        echo "lib_fn$i() { if [ -n \"\$1\" ]; then echo \"fn$i: \$1\"; else result=$i; fi; }"
+done > "$tmpdir/lib"
+# Cold: parsed and stored in the AST cache, warm: loaded from it
+kbench 'sourcing a 5 MB library (cold)' 5 MB "rm -rf '$XDG_CACHE_HOME'; source '$tmpdir/lib'; lib_fn62000 x > /dev/null"
+kbench 'sourcing a 5 MB library (warm)' 5 MB "source '$tmpdir/lib'; lib_fn62000 x > /dev/null"
+
+kbench 'capture throughput' 64 MiB "for i in 1 2 3 4; do x=\$(cat '$tmpdir/capture'); done"
+kbench 'capture with field splitting' 64 MiB "for i in 1 2 3 4; do echo \$(cat '$tmpdir/capture'); done"
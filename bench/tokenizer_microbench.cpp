@@ -0,0 +1,50 @@
+// Tokenizing throughput on inputs that stress the scanning of runs of plain characters:
+// long words, long quoted strings, and a mix of ordinary script lines for comparison.
+// Built twice by `make bench_tokenizer_simd` - with the vectorized scanner and with only the scalar one (KISH_NO_SIMD)
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include "../Tokenizer.h"
+
+static std::string repeat_line(std::string_view line, size_t size) {
+    std::string input;
+    while(input.size() < size)
+        input.append(line);
+    return input;
+}
+
+static void bench(const char *name, const std::string &input) {
+    // Enough repeats for the measurement not to be noise, little enough to be quick
+    static constexpr size_t bytes_to_tokenize = 200'000'000;
+    size_t repeats = bytes_to_tokenize / input.size();
+
+    size_t tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < repeats; i++)
+        tokens += Tokenizer(input).tokenize().size();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double bytes = static_cast<double>(repeats * input.size());
+    printf("%-24s %10.1f MB/s %10.1f Mtokens/s\n", name, bytes / elapsed.count() / 1e6, tokens / elapsed.count() / 1e6);
+}
+
+int main() {
+#if defined(KISH_NO_SIMD)
+    printf("scalar scanner\n");
+#else
+    printf("vectorized scanner (where the target supports it)\n");
+#endif
+
+    static constexpr size_t size = 64 * 1024;
+    bench("script lines", repeat_line(
+        "cmd --flag=some-long-value \"quoted $var and more\" /usr/local/share/kish/file.txt > /dev/null && other | x; y=1\n"
+        "for w in one two three; do x=$(echo \"$w\" | tr a-z A-Z); done # a comment\n", size));
+    bench("long words", repeat_line(
+        "/usr/local/share/applications/org.example.SomeApplication.desktop --some-rather-long-option=with-a-long-value\n", size));
+    bench("single-quoted strings", repeat_line(
+        "echo 'a single-quoted string that goes on for a while, like messages and help texts in scripts do'\n", size));
+    bench("double-quoted strings", repeat_line(
+        "echo \"a double-quoted string with a $variable in it, and then it goes on for a while like messages do\"\n", size));
+    return 0;
+}
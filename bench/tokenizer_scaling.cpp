@@ -0,0 +1,62 @@
+// Measures how the time it takes to tokenize a script grows with its size, from 1 KB to 10 MB.
+// Tokenizing should be linear: the time per byte should stay about the same for every size.
+// Built and run with `make bench_tokenizer`
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include "../Tokenizer.h"
+
+// A mix of what scripts are made of: plain commands, quotes, substitutions, comments and some utf-8
+static constexpr std::string_view script_lines[] = {
+    "cmd --flag=some-long-value \"quoted $var and more\" /usr/local/share/kish/file.txt > /dev/null && other | x; y=1\n",
+    "f() { if [ \"$1\" = x ]; then echo \"matched $1\"; elif test -n \"$2\"; then printf '%s\\n' a b c | grep -v b; fi; }\n",
+    "for w in one two three; do x=$(echo \"$w\" | tr a-z A-Z); done # a comment that's skipped\n",
+    "echo 'zażółć gęślą jaźń' ${HOME}/€ 2>> log\n",
+};
+
+static std::string make_script(size_t size) {
+    std::string script;
+    for(size_t i = 0; script.size() < size; i++)
+        script.append(script_lines[i % std::size(script_lines)]);
+    return script;
+}
+
+int main() {
+    static constexpr size_t sizes[] = { 1'000, 10'000, 100'000, 1'000'000, 10'000'000 };
+    // Every size is tokenized over and over, until about this many bytes were tokenized in total
+    static constexpr size_t bytes_per_size = 50'000'000;
+
+    printf("%12s %12s %12s %12s\n", "bytes", "tokens", "ns/byte", "MB/s");
+
+    double first_ns_per_byte = 0;
+    double last_ns_per_byte = 0;
+    for(size_t size : sizes) {
+        std::string script = make_script(size);
+        size_t repeats = std::max<size_t>(1, bytes_per_size / script.size());
+
+        size_t tokens = 0;
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < repeats; i++)
+            tokens = Tokenizer(script).tokenize().size();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+        double ns_per_byte = elapsed.count() / static_cast<double>(repeats * script.size());
+        printf("%12zu %12zu %12.2f %12.1f\n", script.size(), tokens, ns_per_byte, 1e3 / ns_per_byte);
+
+        if(first_ns_per_byte == 0)
+            first_ns_per_byte = ns_per_byte;
+        last_ns_per_byte = ns_per_byte;
+    }
+
+    // Some growth comes from the caches, a quadratic tokenizer would be thousands of times slower per byte
+    double growth = last_ns_per_byte / first_ns_per_byte;
+    printf("time per byte grew %.2fx from the smallest to the largest input\n", growth);
+    if(growth > 4) {
+        printf("tokenizing isn't linear in the size of the input\n");
+        return 1;
+    }
+    return 0;
+}
@@ -7,6 +7,15 @@
 #include "builtins/colon.h"
 #include "builtins/read.h"
 #include "builtins/source.h"
+#include "builtins/hash.h"
+#include "builtins/type.h"
+#include "builtins/command.h"
+#include "builtins/echo.h"
+#include "builtins/printf.h"
+#include "builtins/test.h"
+#include "builtins/wait.h"
+#include "builtins/parallel.h"
+#include "builtins/set.h"
 
 #include <map>
 #include <unordered_map>
@@ -20,6 +29,16 @@ const std::unordered_map<std::string, BuiltinHandler> *get_builtins() {
         {":", builtin_colon},
         {"read", builtin_read},
         {"source", builtin_source},
+        {"hash", builtin_hash},
+        {"type", builtin_type},
+        {"command", builtin_command},
+        {"echo", builtin_echo},
+        {"printf", builtin_printf},
+        {"test", builtin_test},
+        {"[", builtin_left_bracket},
+        {"wait", builtin_wait},
+        {"parallel", builtin_parallel},
+        {"set", builtin_set},
     };
 
     return &builtins;
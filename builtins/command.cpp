@@ -0,0 +1,65 @@
+#include "command.h"
+#include <stdio.h>
+#include <string>
+#include "type.h"
+#include "../Global.h"
+#include "../builtins.h"
+#include "../executor.h"
+
+static void usage() {
+    fprintf(stderr, "%s\n", "command: command [-v|-V] <command> [arguments...]");
+}
+
+// `command [-v|-V] name [args...]`: runs a builtin or an external command, skipping functions
+int builtin_command(const Command::Simple &cmd) {
+    enum { Run, PrintLocation, Describe } mode = Run;
+
+    std::size_t arg_i = 1;
+    for(; arg_i < cmd.argv.size() && cmd.argv.at(arg_i).starts_with('-'); arg_i++) {
+        if(cmd.argv.at(arg_i) == "-v") {
+            mode = PrintLocation;
+        } else if(cmd.argv.at(arg_i) == "-V") {
+            mode = Describe;
+        } else if(cmd.argv.at(arg_i) == "--") {
+            arg_i++;
+            break;
+        } else {
+            fprintf(stderr, "command: unknown option: '%s'\n", cmd.argv.at(arg_i).c_str());
+            usage();
+            return 1;
+        }
+    }
+
+    if(arg_i >= cmd.argv.size()) {
+        if(mode == Run)
+            return 0;
+        usage();
+        return 1;
+    }
+
+    if(mode == PrintLocation || mode == Describe) {
+        int ret = 0;
+        for(; arg_i < cmd.argv.size(); arg_i++) {
+            if(!describe_command(cmd.argv.at(arg_i), mode == PrintLocation)) {
+                if(mode == Describe)
+                    fprintf(stderr, "command: %s: not found\n", cmd.argv.at(arg_i).c_str());
+                ret = 1;
+            }
+        }
+        fflush(stdout);
+        return ret;
+    }
+
+    Command::Simple shifted;
+    shifted.variable_assignments = cmd.variable_assignments;
+    shifted.argv.assign(cmd.argv.begin() + arg_i, cmd.argv.end());
+
+    if(auto builtin = find_builtin(shifted.argv.at(0)))
+        return builtin.value()(shifted);
+
+    // Redirections are already set up by whoever called this builtin
+    Command external;
+    external.value = std::move(shifted);
+    executor::run_external_command(external);
+    return g.last_return_value;
+}
@@ -0,0 +1,50 @@
+#include "echo.h"
+#include <string>
+#include <unistd.h>
+#include "printf.h"
+#include "../utils.h"
+
+// Behaves like the echo from bash and GNU coreutils: `-n`, `-e` and `-E` are recognized,
+// backslash escapes are not interpreted by default
+int builtin_echo(const Command::Simple &cmd) {
+    bool trailing_newline = true;
+    bool interpret_escapes = false;
+
+    std::size_t arg_i = 1;
+    for(; arg_i < cmd.argv.size(); arg_i++) {
+        const std::string &arg = cmd.argv.at(arg_i);
+        if(arg.size() < 2 || arg.at(0) != '-' || arg.find_first_not_of("neE", 1) != std::string::npos)
+            break;
+
+        for(char option : std::string_view(arg).substr(1)) {
+            if(option == 'n')
+                trailing_newline = false;
+            else if(option == 'e')
+                interpret_escapes = true;
+            else if(option == 'E')
+                interpret_escapes = false;
+        }
+    }
+
+    std::string out;
+    for(std::size_t i = arg_i; i < cmd.argv.size(); i++) {
+        if(i != arg_i)
+            out.push_back(' ');
+
+        if(!interpret_escapes) {
+            out.append(cmd.argv.at(i));
+        } else if(!expand_echo_escapes(cmd.argv.at(i), out)) {
+            trailing_newline = false;
+            break;
+        }
+    }
+
+    if(trailing_newline)
+        out.push_back('\n');
+
+    if(!utils::write_all(STDOUT_FILENO, out)) {
+        perror("echo: write error");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "hash.h"
+#include <stdio.h>
+#include <string>
+#include "../command_hash.h"
+
+static void usage() {
+    fprintf(stderr, "%s\n", "hash: hash [-r] [name...]");
+}
+
+int builtin_hash(const Command::Simple &cmd) {
+    std::size_t arg_i = 1;
+
+    // Handle command line options: [-r]
+    for(; arg_i < cmd.argv.size() && cmd.argv.at(arg_i).starts_with('-'); arg_i++) {
+        if(cmd.argv.at(arg_i) == "-r") {
+            command_hash::forget_all();
+        } else if(cmd.argv.at(arg_i) == "--") {
+            arg_i++;
+            break;
+        } else {
+            fprintf(stderr, "hash: unknown option: '%s'\n", cmd.argv.at(arg_i).c_str());
+            usage();
+            return 1;
+        }
+    }
+
+    // `hash name...` - look up and remember the given commands
+    if(arg_i < cmd.argv.size()) {
+        int ret = 0;
+        for(; arg_i < cmd.argv.size(); arg_i++) {
+            const std::string &name = cmd.argv.at(arg_i);
+            if(name.find('/') != std::string::npos)
+                continue;
+
+            if(command_hash::find(name) == nullptr) {
+                fprintf(stderr, "hash: %s: not found\n", name.c_str());
+                ret = 1;
+            }
+        }
+        return ret;
+    }
+
+    // `hash -r` doesn't print anything
+    if(cmd.argv.size() > 1)
+        return 0;
+
+    if(command_hash::entries().empty()) {
+        fprintf(stderr, "hash: hash table empty\n");
+        return 0;
+    }
+
+    printf("hits\tcommand\n");
+    for(const auto &[name, entry] : command_hash::entries()) {
+        printf("%4d\t%s\n", entry.hits, entry.path.c_str());
+    }
+    fflush(stdout);
+
+    return 0;
+}
@@ -0,0 +1,4 @@
+#pragma once
+#include "../Parser.h"
+
+int builtin_hash(const Command::Simple &cmd);
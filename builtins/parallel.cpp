@@ -0,0 +1,282 @@
+#include "parallel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../executor.h"
+#include "../job_control.h"
+#include "../utils.h"
+
+extern char **environ;
+
+namespace {
+
+struct Options {
+    std::size_t jobs = 0; // 0 - as many as there are CPUs
+    std::size_t max_args = 1;
+    bool pack_arguments = false; // -X
+    bool group_output = true;
+};
+
+struct Job {
+    std::size_t number;
+    pid_t pid;
+    std::vector<std::string> argv;
+
+    // With grouped output, what the job writes is kept here until it finishes
+    int out = -1;
+    int err = -1;
+};
+
+} // namespace
+
+static void usage() {
+    fprintf(stderr, "%s\n", "parallel: parallel [-j jobs] [-n max-args | -X] [-u] command [arguments...] [::: items...]");
+}
+
+static bool parse_count(const std::string &str, std::size_t &into) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(str.c_str(), &end, 10);
+    if(str.empty() || *end != '\0' || errno == ERANGE || value <= 0)
+        return false;
+    into = static_cast<std::size_t>(value);
+    return true;
+}
+
+static std::size_t online_cpus() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? static_cast<std::size_t>(cpus) : 1;
+}
+
+// How many bytes of arguments a single exec() can take, leaving some room for the environment like xargs does
+static std::size_t argument_space() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    std::size_t space = arg_max > 0 ? static_cast<std::size_t>(arg_max) : 4096;
+
+    for(char **env = environ; *env != nullptr; env++)
+        space -= std::min(space, strlen(*env) + 1 + sizeof(char *));
+
+    return space - std::min<std::size_t>(space, 2048);
+}
+
+static std::size_t argument_size(const std::string &arg) {
+    return arg.size() + 1 + sizeof(char *);
+}
+
+// Items are one per line: `find . -name '*.c' | parallel cc -c`
+static void read_items_from_stdin(std::vector<std::string> &items) {
+    std::string input;
+    char buf[BUFSIZ];
+    ssize_t nread;
+    while((nread = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+        if(nread == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("parallel: read");
+            break;
+        }
+        input.append(buf, static_cast<std::size_t>(nread));
+    }
+
+    std::size_t begin = 0;
+    while(begin < input.size()) {
+        std::size_t end = input.find('\n', begin);
+        if(end == std::string::npos)
+            end = input.size();
+        items.emplace_back(input, begin, end - begin);
+        begin = end + 1;
+    }
+}
+
+static bool copy_output(int from, int to) {
+    std::string output;
+    if(!utils::read_whole_file(from, output))
+        return false;
+    return utils::write_all(to, output);
+}
+
+static std::string describe(const std::vector<std::string> &argv) {
+    std::string description;
+    for(const std::string &arg : argv) {
+        if(!description.empty())
+            description.push_back(' ');
+        description.append(arg);
+    }
+    return description;
+}
+
+[[noreturn]]
+static void run_job(const Job &job, bool stdin_from_dev_null) {
+    if(stdin_from_dev_null) {
+        int dev_null = open("/dev/null", O_RDONLY);
+        if(dev_null != -1 && dev_null != STDIN_FILENO) {
+            dup2(dev_null, STDIN_FILENO);
+            close(dev_null);
+        }
+    }
+    if(job.out != -1 && dup2(job.out, STDOUT_FILENO) == -1)
+        exit(1);
+    if(job.err != -1 && dup2(job.err, STDERR_FILENO) == -1)
+        exit(1);
+
+    Command::Simple simple;
+    simple.argv = job.argv;
+
+    Command command;
+    command.value = std::move(simple);
+    executor::exec_simple_command(command);
+}
+
+// `parallel [-j jobs] [-n max-args | -X] [-u] command [arguments...] [::: items...]`
+// Runs `command arguments... item` for every item, at most `jobs` at once.
+// Without `:::`, the items are read from stdin - one per line.
+// -n gives every job up to `max-args` items, -X packs as many as fit into a single exec() while
+// still keeping every job slot busy. The output of every job is printed all at once when it finishes,
+// unless -u is given.
+// The exit status is the number of failed jobs, up to 101
+int builtin_parallel(const Command::Simple &cmd) {
+    Options options;
+
+    std::size_t arg_i = 1;
+    for(; arg_i < cmd.argv.size() && cmd.argv.at(arg_i).starts_with('-'); arg_i++) {
+        const std::string &arg = cmd.argv.at(arg_i);
+        if(arg == "-j" || arg == "-n") {
+            std::size_t &into = arg == "-j" ? options.jobs : options.max_args;
+            if(arg_i + 1 >= cmd.argv.size() || !parse_count(cmd.argv.at(arg_i + 1), into)) {
+                fprintf(stderr, "parallel: %s needs a positive number\n", arg.c_str());
+                usage();
+                return 255;
+            }
+            arg_i++;
+        } else if(arg == "-X") {
+            options.pack_arguments = true;
+        } else if(arg == "-u") {
+            options.group_output = false;
+        } else if(arg == "--") {
+            arg_i++;
+            break;
+        } else {
+            fprintf(stderr, "parallel: unknown option: '%s'\n", arg.c_str());
+            usage();
+            return 255;
+        }
+    }
+
+    auto separator = std::find(cmd.argv.begin() + static_cast<std::ptrdiff_t>(arg_i), cmd.argv.end(), ":::");
+    std::vector<std::string> command(cmd.argv.begin() + static_cast<std::ptrdiff_t>(arg_i), separator);
+    if(command.empty()) {
+        usage();
+        return 255;
+    }
+
+    std::vector<std::string> items;
+    bool items_from_stdin = separator == cmd.argv.end();
+    if(items_from_stdin)
+        read_items_from_stdin(items);
+    else
+        items.assign(separator + 1, cmd.argv.end());
+
+    if(options.jobs == 0)
+        options.jobs = online_cpus();
+
+    std::size_t space_for_items = argument_space();
+    for(const std::string &arg : command)
+        space_for_items -= std::min(space_for_items, argument_size(arg));
+
+    // Spread the items evenly, so that no job slot stays idle
+    std::size_t max_items_per_job = options.max_args;
+    if(options.pack_arguments)
+        max_items_per_job = std::max<std::size_t>(1, (items.size() + options.jobs - 1) / options.jobs);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    std::vector<Job> running;
+    std::vector<pid_t> running_pids;
+    std::size_t next_item = 0, started_jobs = 0, failed_jobs = 0;
+    pid_t pgid = 0;
+
+    while(next_item < items.size() || !running.empty()) {
+        while(running.size() < options.jobs && next_item < items.size()) {
+            Job job;
+            job.number = ++started_jobs;
+            job.argv = command;
+
+            // Pack items while they fit into the argument space - but always take at least one
+            std::size_t used_space = 0, taken = 0;
+            while(next_item < items.size() && taken < max_items_per_job) {
+                std::size_t size = argument_size(items.at(next_item));
+                if(taken != 0 && used_space + size > space_for_items)
+                    break;
+                job.argv.push_back(items.at(next_item));
+                used_space += size;
+                taken++;
+                next_item++;
+            }
+
+            if(options.group_output) {
+                job.out = utils::create_anonymous_file("kish-parallel-stdout");
+                job.err = utils::create_anonymous_file("kish-parallel-stderr");
+            }
+
+            pid_t pid = job_control::fork_into_process_group(pgid, true);
+            if(pid == -1) {
+                perror("parallel: fork");
+                if(job.out != -1)
+                    close(job.out);
+                if(job.err != -1)
+                    close(job.err);
+                failed_jobs++;
+                break;
+            }
+            if(pid == 0)
+                run_job(job, items_from_stdin); // noreturn
+
+            // All the jobs share one process group, which has the terminal like a foreground pipeline
+            pid_t job_pgid = getpgid(pid);
+            if(job_pgid != -1)
+                pgid = job_pgid;
+
+            job.pid = pid;
+            running_pids.push_back(pid);
+            running.push_back(std::move(job));
+        }
+
+        if(running.empty())
+            break;
+
+        job_control::FinishedChild child = job_control::wait_for_any(running_pids);
+
+        auto finished = std::find_if(running.begin(), running.end(), [&](const Job &job) {
+            return job.pid == child.pid;
+        });
+        if(finished == running.end())
+            break;
+
+        if(finished->out != -1) {
+            copy_output(finished->out, STDOUT_FILENO);
+            copy_output(finished->err, STDERR_FILENO);
+            close(finished->out);
+            close(finished->err);
+        }
+
+        if(child.return_value != 0) {
+            fprintf(stderr, "parallel: job %zu (%s) failed with exit status %d\n",
+                    finished->number, describe(finished->argv).c_str(), child.return_value);
+            failed_jobs++;
+        }
+
+        running_pids.erase(std::find(running_pids.begin(), running_pids.end(), child.pid));
+        running.erase(finished);
+    }
+
+    job_control::take_back_terminal();
+
+    return static_cast<int>(std::min<std::size_t>(failed_jobs, 101));
+}
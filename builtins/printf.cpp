@@ -0,0 +1,410 @@
+#include "printf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <optional>
+#include "../Global.h"
+#include "../utils.h"
+
+namespace {
+
+// The arguments following the format string, consumed by conversion specifications
+struct Arguments {
+    const std::vector<std::string> &argv;
+    std::size_t next;
+
+    bool exhausted() const { return next >= argv.size(); }
+
+    // Missing arguments are treated as empty strings (or zeroes)
+    const std::string &take() {
+        static const std::string empty;
+        if(exhausted())
+            return empty;
+        return argv.at(next++);
+    }
+};
+
+enum class Status { CONTINUE, STOP_OUTPUT };
+
+} // namespace
+
+static bool is_octal_digit(char ch) {
+    return ch >= '0' && ch <= '7';
+}
+
+static int hex_digit_value(char ch) {
+    if(utils::no_locale_isdigit(ch))
+        return ch - '0';
+    if(ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if(ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// Appends what the escape sequence starting at `str[i]` (the character after a backslash) means.
+// Moves `i` to the last character of the escape sequence.
+//
+// In `echo_style` (for `echo -e` and `%b`), octal escapes are written as `\0NNN` and `\c` stops all output,
+// otherwise (in printf's format string) they are `\NNN`
+static Status append_escape(std::string_view str, std::size_t &i, bool echo_style, std::string &out) {
+    if(i >= str.size()) {
+        // A lone backslash at the end
+        out.push_back('\\');
+        return Status::CONTINUE;
+    }
+
+    switch(str[i]) {
+    case '\\': out.push_back('\\'); return Status::CONTINUE;
+    case 'a': out.push_back('\a'); return Status::CONTINUE;
+    case 'b': out.push_back('\b'); return Status::CONTINUE;
+    case 'e': out.push_back('\x1b'); return Status::CONTINUE;
+    case 'f': out.push_back('\f'); return Status::CONTINUE;
+    case 'n': out.push_back('\n'); return Status::CONTINUE;
+    case 'r': out.push_back('\r'); return Status::CONTINUE;
+    case 't': out.push_back('\t'); return Status::CONTINUE;
+    case 'v': out.push_back('\v'); return Status::CONTINUE;
+    case '"': out.push_back('"'); return Status::CONTINUE;
+    case '\'': out.push_back('\''); return Status::CONTINUE;
+    case 'c':
+        if(echo_style)
+            return Status::STOP_OUTPUT;
+        break;
+    case 'x': {
+        int value = 0, digits = 0;
+        while(digits < 2 && i + 1 < str.size() && hex_digit_value(str[i + 1]) != -1) {
+            value = value * 16 + hex_digit_value(str[++i]);
+            digits++;
+        }
+        if(digits == 0) {
+            out.append("\\x");
+            return Status::CONTINUE;
+        }
+        out.push_back(static_cast<char>(value));
+        return Status::CONTINUE;
+    }
+    default:
+        break;
+    }
+
+    if(is_octal_digit(str[i]) && (!echo_style || str[i] == '0')) {
+        // echo-style: \0NNN, otherwise \NNN
+        int value = echo_style ? 0 : str[i] - '0';
+        int max_digits = echo_style ? 3 : 2;
+        for(int digits = 0; digits < max_digits && i + 1 < str.size() && is_octal_digit(str[i + 1]); digits++) {
+            value = value * 8 + (str[++i] - '0');
+        }
+        out.push_back(static_cast<char>(value));
+        return Status::CONTINUE;
+    }
+
+    // Not a known escape sequence - keep it as it is
+    out.push_back('\\');
+    out.push_back(str[i]);
+    return Status::CONTINUE;
+}
+
+bool expand_echo_escapes(std::string_view str, std::string &out) {
+    for(std::size_t i = 0; i < str.size(); i++) {
+        if(str[i] != '\\') {
+            out.push_back(str[i]);
+            continue;
+        }
+
+        i++;
+        if(append_escape(str, i, true, out) == Status::STOP_OUTPUT)
+            return false;
+    }
+    return true;
+}
+
+// Quotes `str` so that it can be reused as shell input (`%q`)
+static void append_shell_quoted(std::string_view str, std::string &out) {
+    if(str.empty()) {
+        out.append("''");
+        return;
+    }
+
+    bool has_control_characters = false;
+    for(char ch : str) {
+        if(static_cast<unsigned char>(ch) < 0x20 || ch == 0x7f)
+            has_control_characters = true;
+    }
+
+    if(has_control_characters) {
+        // $'...' can represent anything
+        out.append("$'");
+        for(char ch : str) {
+            switch(ch) {
+            case '\a': out.append("\\a"); break;
+            case '\b': out.append("\\b"); break;
+            case '\x1b': out.append("\\E"); break;
+            case '\f': out.append("\\f"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            case '\v': out.append("\\v"); break;
+            case '\\': out.append("\\\\"); break;
+            case '\'': out.append("\\'"); break;
+            default:
+                if(static_cast<unsigned char>(ch) < 0x20 || ch == 0x7f) {
+                    char octal[5];
+                    snprintf(octal, sizeof octal, "\\%03o", static_cast<unsigned char>(ch));
+                    out.append(octal);
+                } else {
+                    out.push_back(ch);
+                }
+            }
+        }
+        out.push_back('\'');
+        return;
+    }
+
+    for(std::size_t i = 0; i < str.size(); i++) {
+        char ch = str[i];
+        bool special = utils::strchr_no_null(" \"'\\$`!&|;<>()[]{}*?^", ch) != nullptr;
+
+        // `~` and `#` are only special at the beginning of a word
+        if((ch == '~' || ch == '#') && i == 0)
+            special = true;
+
+        if(special)
+            out.push_back('\\');
+        out.push_back(ch);
+    }
+}
+
+template <typename T>
+static void append_formatted(std::string &out, const std::string &spec, T value) {
+    int len = snprintf(nullptr, 0, spec.c_str(), value);
+    if(len <= 0)
+        return;
+
+    std::size_t old_size = out.size();
+    out.resize(old_size + len + 1);
+    snprintf(out.data() + old_size, len + 1, spec.c_str(), value);
+    out.resize(old_size + len);
+}
+
+// Numeric arguments can also be given as a quote followed by a character: `printf %d "'a"` prints 97
+static bool is_character_constant(const std::string &arg) {
+    return arg.size() >= 2 && (arg.at(0) == '\'' || arg.at(0) == '"');
+}
+
+template <typename T>
+static T parse_number(const std::string &arg, T (*convert)(const char *, char **, int), bool &failed) {
+    if(arg.empty())
+        return 0;
+    if(is_character_constant(arg))
+        return static_cast<unsigned char>(arg.at(1));
+
+    char *end;
+    errno = 0;
+    T value = convert(arg.c_str(), &end, 0);
+    if(*end != '\0' || end == arg.c_str()) {
+        fprintf(stderr, "printf: '%s': invalid number\n", arg.c_str());
+        failed = true;
+    } else if(errno == ERANGE) {
+        fprintf(stderr, "printf: '%s': %s\n", arg.c_str(), strerror(ERANGE));
+        failed = true;
+    }
+    return value;
+}
+
+static long double parse_floating(const std::string &arg, bool &failed) {
+    if(arg.empty())
+        return 0;
+    if(is_character_constant(arg))
+        return static_cast<unsigned char>(arg.at(1));
+
+    char *end;
+    long double value = strtold(arg.c_str(), &end);
+    if(*end != '\0' || end == arg.c_str()) {
+        fprintf(stderr, "printf: '%s': invalid number\n", arg.c_str());
+        failed = true;
+    }
+    return value;
+}
+
+// Handles one conversion specification, starting at `format[i]` (just after the '%').
+// Moves `i` to the conversion character
+static Status append_conversion(std::string_view format, std::size_t &i, Arguments &args, std::string &out, bool &failed) {
+    std::string spec = "%";
+
+    while(i < format.size() && utils::strchr_no_null("-+ #0", format[i]) != nullptr) {
+        spec.push_back(format[i++]);
+    }
+
+    // width and precision: digits or `*` to take them from the arguments
+    for(bool precision : { false, true }) {
+        if(precision) {
+            if(i >= format.size() || format[i] != '.')
+                break;
+            spec.push_back(format[i++]);
+        }
+
+        if(i < format.size() && format[i] == '*') {
+            spec.append(std::to_string(parse_number<long long>(args.take(), strtoll, failed)));
+            i++;
+        } else {
+            while(i < format.size() && utils::no_locale_isdigit(format[i])) {
+                spec.push_back(format[i++]);
+            }
+        }
+    }
+
+    // Length modifiers are accepted and ignored - all numbers are converted as the largest types anyway
+    while(i < format.size() && utils::strchr_no_null("hlLjzt", format[i]) != nullptr) {
+        i++;
+    }
+
+    if(i >= format.size()) {
+        fprintf(stderr, "printf: %s: missing format character\n", spec.c_str());
+        failed = true;
+        return Status::STOP_OUTPUT;
+    }
+
+    char conversion = format[i];
+    switch(conversion) {
+    case 's':
+        append_formatted(out, spec + 's', args.take().c_str());
+        return Status::CONTINUE;
+    case 'b': {
+        std::string expanded;
+        bool stop = !expand_echo_escapes(args.take(), expanded);
+        append_formatted(out, spec + 's', expanded.c_str());
+        return stop ? Status::STOP_OUTPUT : Status::CONTINUE;
+    }
+    case 'q': {
+        std::string quoted;
+        append_shell_quoted(args.take(), quoted);
+        append_formatted(out, spec + 's', quoted.c_str());
+        return Status::CONTINUE;
+    }
+    case 'c': {
+        const std::string &arg = args.take();
+        if(arg.empty())
+            append_formatted(out, spec + 's', "");
+        else
+            append_formatted(out, spec + 'c', arg.at(0));
+        return Status::CONTINUE;
+    }
+    case 'd':
+    case 'i':
+        append_formatted(out, spec + "ll" + conversion, parse_number<long long>(args.take(), strtoll, failed));
+        return Status::CONTINUE;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        append_formatted(out, spec + "ll" + conversion, parse_number<unsigned long long>(args.take(), strtoull, failed));
+        return Status::CONTINUE;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        append_formatted(out, spec + 'L' + conversion, parse_floating(args.take(), failed));
+        return Status::CONTINUE;
+    default:
+        fprintf(stderr, "printf: %c: invalid format character\n", conversion);
+        failed = true;
+        return Status::STOP_OUTPUT;
+    }
+}
+
+// Goes through the format string once
+static Status append_printf(std::string_view format, Arguments &args, std::string &out, bool &failed) {
+    for(std::size_t i = 0; i < format.size(); i++) {
+        char ch = format[i];
+
+        if(ch == '\\') {
+            i++;
+            if(append_escape(format, i, false, out) == Status::STOP_OUTPUT)
+                return Status::STOP_OUTPUT;
+        } else if(ch == '%' && i + 1 < format.size() && format[i + 1] == '%') {
+            out.push_back('%');
+            i++;
+        } else if(ch == '%') {
+            i++;
+            if(append_conversion(format, i, args, out, failed) == Status::STOP_OUTPUT)
+                return Status::STOP_OUTPUT;
+        } else {
+            out.push_back(ch);
+        }
+    }
+    return Status::CONTINUE;
+}
+
+static bool is_valid_variable_name(const std::string &name) {
+    if(name.empty() || utils::no_locale_isdigit(name.at(0)))
+        return false;
+    for(char ch : name) {
+        if(!utils::no_locale_isalnum(ch) && ch != '_')
+            return false;
+    }
+    return true;
+}
+
+static void usage() {
+    fprintf(stderr, "%s\n", "printf: printf [-v var] <format> [arguments...]");
+}
+
+int builtin_printf(const Command::Simple &cmd) {
+    std::size_t arg_i = 1;
+    std::optional<std::string> into_variable;
+
+    if(arg_i < cmd.argv.size() && cmd.argv.at(arg_i) == "-v") {
+        if(arg_i + 1 >= cmd.argv.size()) {
+            usage();
+            return 1;
+        }
+        into_variable = cmd.argv.at(arg_i + 1);
+        if(!is_valid_variable_name(into_variable.value())) {
+            fprintf(stderr, "printf: '%s': not a valid variable name\n", into_variable->c_str());
+            return 1;
+        }
+        arg_i += 2;
+    }
+    if(arg_i < cmd.argv.size() && cmd.argv.at(arg_i) == "--")
+        arg_i++;
+
+    if(arg_i >= cmd.argv.size()) {
+        usage();
+        return 1;
+    }
+
+    std::string_view format = cmd.argv.at(arg_i);
+    Arguments args { cmd.argv, arg_i + 1 };
+
+    std::string out;
+    bool failed = false;
+
+    // The format string is reused for as long as there are arguments left
+    while(true) {
+        std::size_t args_before = args.next;
+
+        if(append_printf(format, args, out, failed) == Status::STOP_OUTPUT)
+            break;
+
+        // No arguments were consumed by the format string - it would never end
+        if(args.exhausted() || args.next == args_before)
+            break;
+    }
+
+    if(into_variable.has_value()) {
+        g.variables[into_variable.value()] = std::move(out);
+    } else if(!utils::write_all(STDOUT_FILENO, out)) {
+        perror("printf: write error");
+        return 1;
+    }
+
+    return failed ? 1 : 0;
+}
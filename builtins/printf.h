@@ -0,0 +1,10 @@
+#pragma once
+#include "../Parser.h"
+#include <string>
+#include <string_view>
+
+int builtin_printf(const Command::Simple &cmd);
+
+// Appends `str` with backslash escapes (\n, \t, \0NNN, ...) interpreted like `echo -e` and `printf %b` do.
+// Returns false if a `\c` was encountered - nothing more should be printed then
+bool expand_echo_escapes(std::string_view str, std::string &out);
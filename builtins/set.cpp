@@ -0,0 +1,73 @@
+#include "set.h"
+#include <stdio.h>
+#include <string>
+#include "../Global.h"
+
+namespace {
+
+struct Option {
+    const char *name;
+    bool Global::Options::*value;
+};
+
+constexpr Option options[] = {
+    {"pipefail", &Global::Options::pipefail},
+    {"bytecode", &Global::Options::bytecode},
+};
+
+} // namespace
+
+static bool *find_option(const std::string &name) {
+    for(const Option &option : options) {
+        if(name == option.name)
+            return &(g.options.*option.value);
+    }
+    return nullptr;
+}
+
+static void print_options(bool as_commands) {
+    for(const Option &option : options) {
+        bool enabled = g.options.*option.value;
+        if(as_commands)
+            printf("set %co %s\n", enabled ? '-' : '+', option.name);
+        else
+            printf("%s\t%s\n", option.name, enabled ? "on" : "off");
+    }
+}
+
+// `set -o option`, `set +o option` - enable or disable an option
+// `set -o` lists the options, `set +o` prints them as commands that restore them
+// `set -- args...` replaces the positional parameters
+int builtin_set(const Command::Simple &cmd) {
+    std::size_t arg_i = 1;
+    for(; arg_i < cmd.argv.size(); arg_i++) {
+        const std::string &arg = cmd.argv.at(arg_i);
+
+        if(arg == "--") {
+            g.argv.resize(1);
+            g.argv.insert(g.argv.end(), cmd.argv.begin() + static_cast<std::ptrdiff_t>(arg_i + 1), cmd.argv.end());
+            return 0;
+        }
+
+        if(arg != "-o" && arg != "+o") {
+            fprintf(stderr, "set: unsupported argument: '%s'\n", arg.c_str());
+            return 2;
+        }
+
+        bool enable = arg == "-o";
+        if(arg_i + 1 >= cmd.argv.size()) {
+            print_options(!enable);
+            return 0;
+        }
+
+        const std::string &name = cmd.argv.at(++arg_i);
+        bool *option = find_option(name);
+        if(option == nullptr) {
+            fprintf(stderr, "set: %s: invalid option name\n", name.c_str());
+            return 2;
+        }
+        *option = enable;
+    }
+
+    return 0;
+}
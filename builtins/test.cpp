@@ -0,0 +1,315 @@
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "../utils.h"
+
+namespace {
+
+// Evaluates a single `test` expression. File tests on the same path share a single stat(2) call
+class TestExpression {
+public:
+    explicit TestExpression(const std::vector<std::string> &args, std::size_t begin, std::size_t end)
+        : m_args(args)
+        , m_begin(begin)
+        , m_end(end)
+    {}
+
+    bool evaluate() { return evaluate(m_begin, m_end); }
+
+    struct Error {
+        Error(const std::string &explanation)
+            : explanation(explanation)
+        {}
+        std::string explanation;
+    };
+
+private:
+    const std::vector<std::string> &m_args;
+    std::size_t m_begin, m_end;
+    std::size_t m_pos = 0;
+
+    std::unordered_map<std::string, std::optional<struct stat>> m_stat_cache;
+    std::unordered_map<std::string, std::optional<struct stat>> m_lstat_cache;
+
+    const struct stat *cached_stat(const std::string &path, bool follow_symlinks);
+
+    bool evaluate(std::size_t begin, std::size_t end);
+
+    bool parse_or();
+    bool parse_and();
+    bool parse_not();
+    bool parse_primary();
+    const std::string &next_arg();
+
+    bool unary(const std::string &op, const std::string &operand);
+    bool binary(const std::string &left, const std::string &op, const std::string &right);
+};
+
+} // namespace
+
+static bool is_unary_operator(std::string_view op) {
+    return op.size() == 2 && op[0] == '-' && utils::strchr_no_null("bcdefghkLnOprsStuwxzGa", op[1]) != nullptr;
+}
+
+static bool is_binary_operator(std::string_view op) {
+    return op == "=" || op == "==" || op == "!=" || op == "<" || op == ">"
+        || op == "-eq" || op == "-ne" || op == "-lt" || op == "-le" || op == "-gt" || op == "-ge"
+        || op == "-nt" || op == "-ot" || op == "-ef" || op == "-a" || op == "-o";
+}
+
+static long long parse_integer(const std::string &str) {
+    // surrounding whitespace is allowed: `[ " 1" -eq 1 ]`
+    std::size_t begin = str.find_first_not_of(" \t\n");
+    std::size_t end = str.find_last_not_of(" \t\n");
+    if(begin == std::string::npos)
+        throw TestExpression::Error{str + ": integer expression expected"};
+
+    std::string trimmed = str.substr(begin, end - begin + 1);
+    char *parse_end;
+    errno = 0;
+    long long value = strtoll(trimmed.c_str(), &parse_end, 10);
+    if(*parse_end != '\0' || errno == ERANGE)
+        throw TestExpression::Error{str + ": integer expression expected"};
+
+    return value;
+}
+
+static bool timespec_less(const struct timespec &a, const struct timespec &b) {
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static struct timespec modification_time(const struct stat &st) {
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+
+const struct stat *TestExpression::cached_stat(const std::string &path, bool follow_symlinks) {
+    auto &cache = follow_symlinks ? m_stat_cache : m_lstat_cache;
+
+    auto found = cache.find(path);
+    if(found == cache.end()) {
+        struct stat st;
+        int result = follow_symlinks ? stat(path.c_str(), &st) : lstat(path.c_str(), &st);
+        found = cache.emplace(path, result == 0 ? std::optional<struct stat>{st} : std::nullopt).first;
+    }
+
+    return found->second.has_value() ? &found->second.value() : nullptr;
+}
+
+bool TestExpression::unary(const std::string &op, const std::string &operand) {
+    if(op == "-n")
+        return !operand.empty();
+    if(op == "-z")
+        return operand.empty();
+    if(op == "-t")
+        return isatty(static_cast<int>(parse_integer(operand)));
+
+    if(op == "-h" || op == "-L") {
+        const struct stat *st = cached_stat(operand, false);
+        return st && S_ISLNK(st->st_mode);
+    }
+
+    const struct stat *st = cached_stat(operand, true);
+    if(st == nullptr)
+        return false;
+
+    // The permission checks need access(2) to be correct with ACLs and read-only filesystems,
+    // but a missing file has already been ruled out by the cached stat
+    if(op == "-r")
+        return faccessat(AT_FDCWD, operand.c_str(), R_OK, AT_EACCESS) == 0;
+    if(op == "-w")
+        return faccessat(AT_FDCWD, operand.c_str(), W_OK, AT_EACCESS) == 0;
+    if(op == "-x")
+        return faccessat(AT_FDCWD, operand.c_str(), X_OK, AT_EACCESS) == 0;
+
+    switch(op.at(1)) {
+    case 'a':
+    case 'e': return true;
+    case 'b': return S_ISBLK(st->st_mode);
+    case 'c': return S_ISCHR(st->st_mode);
+    case 'd': return S_ISDIR(st->st_mode);
+    case 'f': return S_ISREG(st->st_mode);
+    case 'p': return S_ISFIFO(st->st_mode);
+    case 'S': return S_ISSOCK(st->st_mode);
+    case 's': return st->st_size > 0;
+    case 'g': return st->st_mode & S_ISGID;
+    case 'u': return st->st_mode & S_ISUID;
+    case 'k': return st->st_mode & S_ISVTX;
+    case 'O': return st->st_uid == geteuid();
+    case 'G': return st->st_gid == getegid();
+    }
+
+    throw Error{op + ": unary operator expected"};
+}
+
+bool TestExpression::binary(const std::string &left, const std::string &op, const std::string &right) {
+    if(op == "=" || op == "==")
+        return left == right;
+    if(op == "!=")
+        return left != right;
+    if(op == "<")
+        return left < right;
+    if(op == ">")
+        return left > right;
+    if(op == "-a")
+        return !left.empty() && !right.empty();
+    if(op == "-o")
+        return !left.empty() || !right.empty();
+
+    if(op == "-eq")
+        return parse_integer(left) == parse_integer(right);
+    if(op == "-ne")
+        return parse_integer(left) != parse_integer(right);
+    if(op == "-lt")
+        return parse_integer(left) < parse_integer(right);
+    if(op == "-le")
+        return parse_integer(left) <= parse_integer(right);
+    if(op == "-gt")
+        return parse_integer(left) > parse_integer(right);
+    if(op == "-ge")
+        return parse_integer(left) >= parse_integer(right);
+
+    const struct stat *left_st = cached_stat(left, true);
+    const struct stat *right_st = cached_stat(right, true);
+
+    // Like in bash and ksh, an existing file is newer than a missing one
+    if(op == "-nt")
+        return left_st && (!right_st || timespec_less(modification_time(*right_st), modification_time(*left_st)));
+    if(op == "-ot")
+        return right_st && (!left_st || timespec_less(modification_time(*left_st), modification_time(*right_st)));
+    if(op == "-ef")
+        return left_st && right_st && left_st->st_dev == right_st->st_dev && left_st->st_ino == right_st->st_ino;
+
+    throw Error{op + ": binary operator expected"};
+}
+
+// IEEE Std 1003.1-2017 decides how to evaluate up to four arguments based on the argument count.
+// This makes `[ "$var" = "!" ]` or `[ -n ]` work as expected.
+// Longer expressions are parsed with operator precedence: `!` binds tighter than `-a`, which binds tighter than `-o`
+bool TestExpression::evaluate(std::size_t begin, std::size_t end) {
+    std::size_t count = end - begin;
+
+    switch(count) {
+    case 0:
+        return false;
+    case 1:
+        return !m_args.at(begin).empty();
+    case 2:
+        if(m_args.at(begin) == "!")
+            return !evaluate(begin + 1, end);
+        if(is_unary_operator(m_args.at(begin)))
+            return unary(m_args.at(begin), m_args.at(begin + 1));
+        break;
+    case 3:
+        if(is_binary_operator(m_args.at(begin + 1)))
+            return binary(m_args.at(begin), m_args.at(begin + 1), m_args.at(begin + 2));
+        if(m_args.at(begin) == "!")
+            return !evaluate(begin + 1, end);
+        if(m_args.at(begin) == "(" && m_args.at(end - 1) == ")")
+            return evaluate(begin + 1, end - 1);
+        break;
+    case 4:
+        if(m_args.at(begin) == "!")
+            return !evaluate(begin + 1, end);
+        if(m_args.at(begin) == "(" && m_args.at(end - 1) == ")")
+            return evaluate(begin + 1, end - 1);
+        break;
+    }
+
+    m_pos = begin;
+    m_end = end;
+    bool result = parse_or();
+    if(m_pos != m_end)
+        throw Error{m_args.at(m_pos) + ": unexpected argument"};
+    return result;
+}
+
+const std::string &TestExpression::next_arg() {
+    if(m_pos >= m_end)
+        throw Error{"argument expected"};
+    return m_args.at(m_pos++);
+}
+
+bool TestExpression::parse_or() {
+    bool result = parse_and();
+    while(m_pos < m_end && m_args.at(m_pos) == "-o") {
+        m_pos++;
+        bool right = parse_and();
+        result = result || right;
+    }
+    return result;
+}
+
+bool TestExpression::parse_and() {
+    bool result = parse_not();
+    while(m_pos < m_end && m_args.at(m_pos) == "-a") {
+        m_pos++;
+        bool right = parse_not();
+        result = result && right;
+    }
+    return result;
+}
+
+bool TestExpression::parse_not() {
+    if(m_pos < m_end && m_args.at(m_pos) == "!") {
+        m_pos++;
+        return !parse_not();
+    }
+    return parse_primary();
+}
+
+bool TestExpression::parse_primary() {
+    const std::string &arg = next_arg();
+
+    if(arg == "(") {
+        bool result = parse_or();
+        if(next_arg() != ")")
+            throw Error{"')' expected"};
+        return result;
+    }
+
+    // `left op right`
+    if(m_pos + 1 < m_end && is_binary_operator(m_args.at(m_pos)) && m_args.at(m_pos) != "-a" && m_args.at(m_pos) != "-o") {
+        const std::string &op = next_arg();
+        return binary(arg, op, next_arg());
+    }
+
+    // `-op operand`
+    if(is_unary_operator(arg) && m_pos < m_end)
+        return unary(arg, next_arg());
+
+    return !arg.empty();
+}
+
+static int run_test(const char *name, const std::vector<std::string> &args, std::size_t end) {
+    try {
+        return TestExpression(args, 1, end).evaluate() ? 0 : 1;
+    } catch(const TestExpression::Error &e) {
+        fprintf(stderr, "%s: %s\n", name, e.explanation.c_str());
+        return 2;
+    }
+}
+
+int builtin_test(const Command::Simple &cmd) {
+    return run_test("test", cmd.argv, cmd.argv.size());
+}
+
+int builtin_left_bracket(const Command::Simple &cmd) {
+    if(cmd.argv.size() < 2 || cmd.argv.back() != "]") {
+        fprintf(stderr, "[: missing ']'\n");
+        return 2;
+    }
+    return run_test("[", cmd.argv, cmd.argv.size() - 1);
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include "../Parser.h"
+
+int builtin_test(const Command::Simple &cmd);
+
+// `[ ... ]` - same as `test`, but requires a closing ']'
+int builtin_left_bracket(const Command::Simple &cmd);
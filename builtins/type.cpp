@@ -0,0 +1,82 @@
+#include "type.h"
+#include <stdio.h>
+#include <string>
+#include <array>
+#include <algorithm>
+#include <string_view>
+#include <unistd.h>
+#include "../Global.h"
+#include "../builtins.h"
+#include "../command_hash.h"
+
+static bool is_reserved_word(std::string_view name) {
+    static constexpr std::array<std::string_view, 16> reserved_words {
+        "!", "{", "}", "case", "do", "done", "elif", "else",
+        "esac", "fi", "for", "if", "in", "then", "until", "while"
+    };
+    return std::find(reserved_words.begin(), reserved_words.end(), name) != reserved_words.end();
+}
+
+bool describe_command(const std::string &name, bool only_location) {
+    if(is_reserved_word(name)) {
+        if(only_location)
+            printf("%s\n", name.c_str());
+        else
+            printf("%s is a shell keyword\n", name.c_str());
+        return true;
+    }
+
+    if(g.functions.contains(name)) {
+        if(only_location)
+            printf("%s\n", name.c_str());
+        else
+            printf("%s is a function\n", name.c_str());
+        return true;
+    }
+
+    if(find_builtin(name).has_value()) {
+        if(only_location)
+            printf("%s\n", name.c_str());
+        else
+            printf("%s is a shell builtin\n", name.c_str());
+        return true;
+    }
+
+    if(name.find('/') != std::string::npos) {
+        if(access(name.c_str(), X_OK) != 0)
+            return false;
+
+        if(only_location)
+            printf("%s\n", name.c_str());
+        else
+            printf("%s is %s\n", name.c_str(), name.c_str());
+        return true;
+    }
+
+    bool was_hashed = command_hash::entries().contains(name);
+    const command_hash::Entry *entry = command_hash::find(name);
+    if(entry == nullptr)
+        return false;
+
+    if(only_location)
+        printf("%s\n", entry->path.c_str());
+    else if(was_hashed)
+        printf("%s is hashed (%s)\n", name.c_str(), entry->path.c_str());
+    else
+        printf("%s is %s\n", name.c_str(), entry->path.c_str());
+    return true;
+}
+
+int builtin_type(const Command::Simple &cmd) {
+    int ret = 0;
+
+    for(std::size_t i = 1; i < cmd.argv.size(); i++) {
+        if(!describe_command(cmd.argv.at(i), false)) {
+            fprintf(stderr, "type: %s: not found\n", cmd.argv.at(i).c_str());
+            ret = 1;
+        }
+    }
+    fflush(stdout);
+
+    return ret;
+}
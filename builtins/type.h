@@ -0,0 +1,10 @@
+#pragma once
+#include "../Parser.h"
+#include <string>
+
+int builtin_type(const Command::Simple &cmd);
+
+// Prints what `name` would run as. With `only_location`, only prints the path
+// or name of the command, like `command -v` does.
+// Returns false if `name` isn't a command
+bool describe_command(const std::string &name, bool only_location);
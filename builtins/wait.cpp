@@ -0,0 +1,39 @@
+#include "wait.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string>
+#include "../job_control.h"
+
+int builtin_wait(const Command::Simple &cmd) {
+    // `wait` - wait for every background job, always succeeds
+    if(cmd.argv.size() == 1) {
+        job_control::wait_for_background_jobs();
+        return 0;
+    }
+
+    // `wait pid...` - the exit status is the one of the last pid
+    int ret = 0;
+    for(std::size_t arg_i = 1; arg_i < cmd.argv.size(); arg_i++) {
+        const std::string &arg = cmd.argv.at(arg_i);
+
+        char *end;
+        errno = 0;
+        long pid = strtol(arg.c_str(), &end, 10);
+        if(arg.empty() || *end != '\0' || errno == ERANGE || pid <= 0) {
+            fprintf(stderr, "wait: '%s': not a pid\n", arg.c_str());
+            ret = 2;
+            continue;
+        }
+
+        std::optional<int> job_return_value = job_control::wait_for_background_job(static_cast<pid_t>(pid));
+        if(!job_return_value.has_value()) {
+            fprintf(stderr, "wait: pid %ld is not a child of this shell\n", pid);
+            ret = 127;
+            continue;
+        }
+        ret = job_return_value.value();
+    }
+
+    return ret;
+}
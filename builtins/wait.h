@@ -0,0 +1,4 @@
+#pragma once
+#include "../Parser.h"
+
+int builtin_wait(const Command::Simple &cmd);
@@ -0,0 +1,338 @@
+#include "bytecode.h"
+#include <stdio.h>
+#include <deque>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include "Global.h"
+#include "CommandExpander.h"
+#include "executor.h"
+#include "utils.h"
+
+namespace bytecode {
+
+namespace {
+
+// Lowers the parse tree the same way the tree walker in executor.cpp runs it
+class Compiler {
+public:
+    explicit Compiler(std::vector<Instruction> &code)
+        : code(code)
+    { }
+
+    void command_list(const CommandList &cl, bool exit_after) {
+        for(const WithFollowingOperator<AndOrList> &aol_op : cl) {
+            // aol_and_op.following_operator is ";" or "" or "&"
+            if(aol_op.following_operator == "&") {
+                emit(Instruction::RunInBackground).and_or_list = &aol_op.val;
+            } else {
+                and_or_list(aol_op.val, exit_after && &aol_op == &cl.back());
+            }
+        }
+    }
+
+private:
+    std::vector<Instruction> &code;
+
+    Instruction &emit(Instruction::Opcode opcode, std::uint32_t operand = 0) {
+        Instruction &instruction = code.emplace_back();
+        instruction.opcode = opcode;
+        instruction.operand = operand;
+        return instruction;
+    }
+
+    std::uint32_t here() const {
+        return static_cast<std::uint32_t>(code.size());
+    }
+
+    // Emits a jump whose target is set later with jump_here()
+    std::size_t emit_jump(Instruction::Opcode opcode) {
+        emit(opcode);
+        return code.size() - 1;
+    }
+
+    void jump_here(std::size_t jump) {
+        code[jump].operand = here();
+    }
+
+    void and_or_list(const AndOrList &aol, bool exit_after) {
+        // `a && b || c` stops at the first operator whose condition doesn't hold, like the tree walker does
+        std::vector<std::size_t> jumps_to_end;
+        for(const WithFollowingOperator<Pipeline> &pipe_op : aol) {
+            pipeline(pipe_op.val, exit_after && &pipe_op == &aol.back());
+
+            if(pipe_op.following_operator == "&&")
+                jumps_to_end.push_back(emit_jump(Instruction::JumpIfStatusNonzero));
+            else if(pipe_op.following_operator == "||")
+                jumps_to_end.push_back(emit_jump(Instruction::JumpIfStatusZero));
+        }
+
+        for(std::size_t jump : jumps_to_end)
+            jump_here(jump);
+    }
+
+    void pipeline(const Pipeline &pipeline, bool exit_after) {
+        if(pipeline.commands.size() == 0) {
+            emit(Instruction::SetStatus, 0);
+        } else if(pipeline.commands.size() == 1) {
+            // `! cmd` still has to negate the return value after `cmd` finishes
+            command(pipeline.commands.at(0), exit_after && !pipeline.negation_prefix);
+        } else {
+            emit(Instruction::RunPipeline).pipeline = &pipeline;
+        }
+
+        if(pipeline.negation_prefix)
+            emit(Instruction::Negate);
+    }
+
+    void command(const Command &cmd, bool exit_after) {
+        std::visit(utils::overloaded {
+              [&] (const Command::Empty &) { emit(Instruction::RunEmpty).command = &cmd; },
+              [&] (const Command::Simple &) {
+                  Instruction &instruction = emit(Instruction::RunSimple);
+                  instruction.command = &cmd;
+                  instruction.exit_after = exit_after;
+              },
+              [&] (const Command::BraceGroup &brace_group) {
+                  with_redirections(cmd, [&] {
+                      command_list(brace_group.command_list, exit_after);
+                  });
+              },
+              [&] (const Command::If &if_command) { with_redirections(cmd, [&] { if_(if_command, exit_after); }); },
+              [&] (const Command::While &while_command) {
+                  with_redirections(cmd, [&] { loop(while_command.condition, while_command.body, Instruction::JumpIfTestFailed); });
+              },
+              [&] (const Command::Until &until_command) {
+                  with_redirections(cmd, [&] { loop(until_command.condition, until_command.body, Instruction::JumpIfTestSucceeded); });
+              },
+              [&] (const Command::For &) { for_(cmd); },
+              [&] (const Command::FunctionDefinition &) { emit(Instruction::DefineFunction).command = &cmd; },
+        }, cmd.value);
+    }
+
+    template <typename F>
+    void with_redirections(const Command &cmd, F &&body) {
+        if(cmd.redirections.empty()) {
+            body();
+            return;
+        }
+
+        std::size_t redirect = emit_jump(Instruction::Redirect);
+        code[redirect].command = &cmd;
+        body();
+        emit(Instruction::RestoreRedirections);
+        jump_here(redirect);
+    }
+
+    // Runs the condition, leaving $? at 0 like `if` and loops do
+    void condition(const CommandList &condition) {
+        emit(Instruction::SetStatus, 0); // if ; ; then ...  <-  should not depend on $?
+        command_list(condition, false);
+        emit(Instruction::Test);
+    }
+
+    void if_(const Command::If &if_command, bool exit_after) {
+        std::vector<std::size_t> jumps_to_end;
+
+        condition(if_command.condition);
+        std::size_t to_next_branch = emit_jump(Instruction::JumpIfTestFailed);
+        command_list(if_command.then, exit_after);
+
+        for(const auto &elif : if_command.elif) {
+            jumps_to_end.push_back(emit_jump(Instruction::Jump));
+            jump_here(to_next_branch);
+
+            condition(elif.condition);
+            to_next_branch = emit_jump(Instruction::JumpIfTestFailed);
+            command_list(elif.then, exit_after);
+        }
+
+        if(if_command.opt_else.has_value()) {
+            jumps_to_end.push_back(emit_jump(Instruction::Jump));
+            jump_here(to_next_branch);
+            command_list(if_command.opt_else.value(), exit_after);
+        } else {
+            jump_here(to_next_branch);
+        }
+
+        for(std::size_t jump : jumps_to_end)
+            jump_here(jump);
+    }
+
+    void loop(const CommandList &condition_list, const CommandList &body, Instruction::Opcode exit_jump) {
+        std::uint32_t start = here();
+        condition(condition_list);
+        std::size_t to_end = emit_jump(exit_jump);
+        command_list(body, false);
+        emit(Instruction::Jump, start);
+        jump_here(to_end);
+    }
+
+    void for_(const Command &cmd) {
+        const Command::For &for_command = std::get<Command::For>(cmd.value);
+
+        // TODO: the redirections of for loops are expanded, but not applied - same as in the tree walker
+        std::optional<std::size_t> check;
+        if(!cmd.redirections.empty()) {
+            check = emit_jump(Instruction::CheckRedirections);
+            code[*check].command = &cmd;
+        }
+
+        // Note: for loops do not reset $?
+        emit(Instruction::ForExpand).command = &cmd;
+        std::uint32_t next = here();
+        std::size_t to_end = emit_jump(Instruction::ForNext);
+        code[to_end].command = &cmd;
+        command_list(for_command.body, false);
+        emit(Instruction::Jump, next);
+        jump_here(to_end);
+
+        if(check)
+            jump_here(*check);
+    }
+};
+
+struct ForLoop {
+    std::vector<std::string> items;
+    std::size_t next = 0;
+};
+
+struct CompiledFunction {
+    // Keeps the body alive while it's cached, so that its address can't be taken by another one
+    std::shared_ptr<const CommandList> body;
+    std::optional<Program> programs[2]; // [exit_after]
+};
+
+std::unordered_map<const CommandList*, CompiledFunction> compiled_functions;
+
+// Drops the programs of function bodies that aren't defined (or running) anymore
+void forget_unused_functions() {
+    if(compiled_functions.size() < 64)
+        return;
+
+    std::erase_if(compiled_functions, [](const auto &entry) {
+        return entry.second.body.use_count() == 1;
+    });
+}
+
+} // namespace
+
+Program compile(const CommandList &command_list, bool exit_after) {
+    Program program;
+    Compiler(program.code).command_list(command_list, exit_after);
+    return program;
+}
+
+void run(const Program &program) {
+    std::vector<std::deque<int>> saved_fds;
+    std::vector<ForLoop> for_loops;
+    int test_result = 0;
+
+    const std::vector<Instruction> &code = program.code;
+    for(std::size_t pc = 0; pc < code.size(); ) {
+        const Instruction &instruction = code[pc++];
+
+        switch(instruction.opcode) {
+        case Instruction::RunSimple:
+            executor::run_simple_command_expand_in_main_process(*instruction.command, instruction.exit_after);
+            g.pipestatus.assign(1, g.last_return_value);
+            break;
+        case Instruction::RunEmpty:
+            executor::run_empty_command_expand_in_main_process(*instruction.command);
+            g.pipestatus.assign(1, g.last_return_value);
+            break;
+        case Instruction::DefineFunction:
+            executor::run_function_definition_command_expand_in_main_process(*instruction.command);
+            break;
+        case Instruction::RunPipeline:
+            executor::run_multi_command_pipeline(*instruction.pipeline);
+            break;
+        case Instruction::RunInBackground:
+            executor::run_and_or_list_in_background(*instruction.and_or_list);
+            break;
+        case Instruction::SetStatus:
+            g.last_return_value = static_cast<int>(instruction.operand);
+            break;
+        case Instruction::Negate:
+            g.last_return_value = !g.last_return_value;
+            break;
+        case Instruction::Test:
+            test_result = g.last_return_value;
+            g.last_return_value = 0; // if false; then :; fi  <-  should reset $? to 0
+            break;
+        case Instruction::JumpIfTestFailed:
+            if(test_result != 0)
+                pc = instruction.operand;
+            break;
+        case Instruction::JumpIfTestSucceeded:
+            if(test_result == 0)
+                pc = instruction.operand;
+            break;
+        case Instruction::JumpIfStatusZero:
+            if(g.last_return_value == 0)
+                pc = instruction.operand;
+            break;
+        case Instruction::JumpIfStatusNonzero:
+            if(g.last_return_value != 0)
+                pc = instruction.operand;
+            break;
+        case Instruction::Jump:
+            pc = instruction.operand;
+            break;
+        case Instruction::Redirect:
+            if(std::optional<std::deque<int>> fds = executor::expand_and_setup_redirections(*instruction.command))
+                saved_fds.push_back(std::move(fds.value()));
+            else
+                pc = instruction.operand;
+            break;
+        case Instruction::CheckRedirections: {
+            Redirections redirections;
+            if(!CommandExpander(*instruction.command).expand_redirections_into(redirections)) {
+                fprintf(stderr, "Command expansion failed\n");
+                g.last_return_value = 1;
+                pc = instruction.operand;
+            }
+            break;
+        }
+        case Instruction::RestoreRedirections:
+            executor::restore_old_fds(saved_fds.back());
+            saved_fds.pop_back();
+            break;
+        case Instruction::ForExpand:
+            executor::expand_for_items(std::get<Command::For>(instruction.command->value), for_loops.emplace_back().items);
+            break;
+        case Instruction::ForNext: {
+            ForLoop &loop = for_loops.back();
+            if(loop.next == loop.items.size()) {
+                for_loops.pop_back();
+                pc = instruction.operand;
+                break;
+            }
+
+            // Note: for loops should not create a new scope for the looped-over variable
+            // `for x in 1 2 3; do :; done; echo $x` -> 3
+            g.variables[std::get<Command::For>(instruction.command->value).varname] = std::move(loop.items[loop.next++]);
+            break;
+        }
+        }
+    }
+}
+
+void run_function(const std::shared_ptr<const CommandList> &body, bool exit_after) {
+    auto found = compiled_functions.find(body.get());
+    if(found == compiled_functions.end()) {
+        forget_unused_functions();
+        found = compiled_functions.emplace(body.get(), CompiledFunction{body, {}}).first;
+    }
+
+    // The entry stays put even if more functions get compiled while this one runs,
+    // and isn't forgotten, as the caller holds on to `body`
+    std::optional<Program> &program = found->second.programs[exit_after];
+    if(!program)
+        program = compile(*body, exit_after);
+
+    run(program.value());
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Parser.h"
+
+// An alternative to the tree walker in executor.cpp (which stays the reference implementation):
+// command lists are lowered to a flat list of instructions, and control flow - `&&`, `||`, `!`, `if`, loops,
+// brace groups - becomes jumps on $? instead of visits of the parse tree.
+// Simple commands, pipelines and background lists are still run by the executor.
+// Enabled with `set -o bytecode`
+namespace bytecode {
+
+struct Instruction {
+    enum Opcode : std::uint8_t {
+        RunSimple, // a simple command in the shell process
+        RunEmpty, // a command of only redirections: `>file`
+        DefineFunction,
+        RunPipeline, // a pipeline of more than one command
+        RunInBackground, // `a && b &`
+        SetStatus, // $? = operand
+        Negate, // $? = !$?
+        Test, // take $? as the result of a condition, resetting it to 0
+        JumpIfTestFailed,
+        JumpIfTestSucceeded,
+        JumpIfStatusZero,
+        JumpIfStatusNonzero,
+        Jump,
+        Redirect, // apply the redirections of a compound command, or jump to `operand` if they can't be expanded
+        CheckRedirections, // only expand them, jumping to `operand` if that fails
+        RestoreRedirections,
+        ForExpand, // expand the items of a for loop
+        ForNext, // assign the next item of the innermost for loop, or jump to `operand` once there are none left
+    };
+
+    Opcode opcode;
+    bool exit_after = false; // RunSimple: this is the last thing the shell runs
+    std::uint32_t operand = 0; // the jump target, or the status of SetStatus
+
+    // The part of the parse tree that's run
+    union {
+        const Command *command = nullptr;
+        const Pipeline *pipeline;
+        const AndOrList *and_or_list;
+    };
+};
+
+// Refers to the parse tree it was compiled from, which has to outlive it
+struct Program {
+    std::vector<Instruction> code;
+};
+
+// `exit_after` means the same as for the executor: the shell exits right after running the program
+Program compile(const CommandList &command_list, bool exit_after = false);
+void run(const Program &program);
+
+// Runs a function body, compiling it only the first time it's called
+void run_function(const std::shared_ptr<const CommandList> &body, bool exit_after);
+
+}
@@ -0,0 +1,172 @@
+#include "command_hash.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <optional>
+#include "Global.h"
+#include "utils.h"
+
+namespace command_hash {
+
+static std::unordered_map<std::string, Entry> table;
+
+// The value of $PATH the table was filled with
+static std::optional<std::string> table_path;
+
+struct DirectoryListing {
+    struct timespec mtime;
+    std::vector<std::string> executables;
+};
+static std::unordered_map<std::string, DirectoryListing> directory_listings;
+
+// check if a potentially signed or unsigned numeric value is less than zero
+// without compiler warnings if the number is indeed signed
+//
+// used for checking if stat.st_mode is not negative
+template <typename T, typename std::enable_if<std::is_unsigned<T>::value, bool>::type = true>
+static bool is_negative(T) { return false; }
+
+template <typename T, typename std::enable_if<std::is_signed<T>::value, bool>::type = true>
+static bool is_negative(T number) { return number < 0; }
+
+static bool is_executable_file(const std::string &path) {
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0)
+        return false;
+    if(is_negative(st.st_mode))
+        return false;
+    if(!S_ISREG(st.st_mode))
+        return false;
+    return st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH);
+}
+
+// Empties the table if $PATH has changed since it was filled.
+// Returns the current $PATH
+static std::optional<std::string> invalidate_if_path_changed() {
+    std::optional<std::string> path = g.get_variable("PATH");
+    if(path != table_path) {
+        table.clear();
+        table_path = path;
+    }
+    return path;
+}
+
+static const Entry *find(const std::string &name, bool count_hit) {
+    if(name.empty() || name.find('/') != std::string::npos)
+        return nullptr;
+
+    std::optional<std::string> path = invalidate_if_path_changed();
+
+    auto found = table.find(name);
+    if(found != table.end()) {
+        if(count_hit)
+            found->second.hits += 1;
+        return &found->second;
+    }
+
+    if(!path.has_value())
+        return nullptr;
+
+    // Lookups in relative directories from $PATH (like "." or "bin") depend on the current directory,
+    // so they are returned from here but not remembered in the table
+    static Entry relative_entry;
+
+    return utils::Splitter(path.value()).delim(':').for_each<const Entry *>([&] (const std::string &dir) -> std::optional<const Entry *> {
+        std::string command_path = (dir.empty() ? std::string{"."} : dir) + "/" + name;
+        if(!is_executable_file(command_path))
+            return {};
+
+        if(command_path.at(0) != '/') {
+            relative_entry = Entry{command_path, 0};
+            return { &relative_entry };
+        }
+
+        Entry &entry = table[name];
+        entry.path = std::move(command_path);
+        entry.hits = count_hit ? 1 : 0;
+        return { &entry };
+    }).value_or(nullptr);
+}
+
+const Entry *find(const std::string &name) {
+    return find(name, false);
+}
+
+const Entry *find_for_exec(const std::string &name) {
+    return find(name, true);
+}
+
+void forget(const std::string &name) {
+    table.erase(name);
+}
+
+void forget_all() {
+    table.clear();
+}
+
+const std::unordered_map<std::string, Entry> &entries() {
+    invalidate_if_path_changed();
+    return table;
+}
+
+static struct timespec modification_time(const struct stat &st) {
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+
+static const DirectoryListing &list_directory(const std::string &dir) {
+    static const DirectoryListing empty_listing {};
+
+    struct stat st;
+    if(stat(dir.c_str(), &st) != 0) {
+        directory_listings.erase(dir);
+        return empty_listing;
+    }
+
+    // Relative directories mean something else after a `cd`, so their listings can't be reused
+    static DirectoryListing relative_listing;
+    bool cacheable = dir.at(0) == '/';
+
+    auto cached = directory_listings.find(dir);
+    if(cacheable && cached != directory_listings.end()
+            && cached->second.mtime.tv_sec == modification_time(st).tv_sec
+            && cached->second.mtime.tv_nsec == modification_time(st).tv_nsec) {
+        return cached->second;
+    }
+
+    DirectoryListing &listing = cacheable ? directory_listings[dir] : relative_listing;
+    listing.mtime = modification_time(st);
+    listing.executables.clear();
+
+    if(DIR *d = opendir(dir.c_str())) {
+        while(struct dirent *entry = readdir(d)) {
+            if(entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+                continue;
+
+            if(is_executable_file(dir + "/" + entry->d_name))
+                listing.executables.emplace_back(entry->d_name);
+        }
+        closedir(d);
+    }
+
+    return listing;
+}
+
+void commands_starting_with(std::string_view prefix, std::vector<std::string> &out) {
+    std::optional<std::string> path = g.get_variable("PATH");
+    if(!path.has_value())
+        return;
+
+    utils::Splitter(path.value()).delim(':').for_each([&] (const std::string &dir) -> utils::Splitter::ShouldContinue {
+        for(const std::string &executable : list_directory(dir.empty() ? "." : dir).executables) {
+            if(executable.starts_with(prefix))
+                out.push_back(executable);
+        }
+        return utils::Splitter::CONTINUE_LOOP;
+    });
+}
+
+} // namespace command_hash
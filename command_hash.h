@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// A shell-wide table of where external commands are located in $PATH.
+// Filled as commands are looked up, emptied when $PATH changes.
+namespace command_hash {
+
+struct Entry {
+    std::string path;
+    int hits = 0; // how many times the command was executed through this entry
+};
+
+// Searches $PATH for an executable regular file named `name`, like execvp(3) would.
+// Returns nullptr if there isn't one. Names containing a '/' aren't searched for.
+// The returned pointer is valid until the next call to a function from this namespace
+const Entry *find(const std::string &name);
+
+// Like find(), but also counts the lookup as a hit - to be used right before executing a command
+const Entry *find_for_exec(const std::string &name);
+
+// Drop a remembered location, for example because it turned out to be stale
+void forget(const std::string &name);
+void forget_all();
+
+const std::unordered_map<std::string, Entry> &entries();
+
+// Names of all executables in $PATH starting with `prefix`. Directory listings are cached
+// and only re-read when the directory changes
+void commands_starting_with(std::string_view prefix, std::vector<std::string> &out);
+
+}
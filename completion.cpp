@@ -7,23 +7,13 @@
 #include "Tokenizer.h"
 #include "Token.h"
 #include "builtins.h"
+#include "command_hash.h"
 
 using replxx::Replxx;
 
 namespace completion {
 
-static void push_prefixed_completion(std::vector<Replxx::Completion> &out, std::string &&completed_word) {
-    if(completed_word.empty())
-        return;
-
-    std::size_t slash = completed_word.rfind('/', completed_word.size() - 1);
-    if(slash != std::string::npos)
-        completed_word.erase(completed_word.begin(), completed_word.begin() + slash + 1);
-
-    out.emplace_back(std::move(completed_word));
-}
-
-static void complete_word_path(std::vector<Replxx::Completion> &out, std::string_view word, bool getRidOfFulPathSlashes = false) {
+static void complete_word_path(std::vector<Replxx::Completion> &out, std::string_view word) {
     std::string pattern(word);
     pattern.push_back('*');
 
@@ -33,12 +23,7 @@ static void complete_word_path(std::vector<Replxx::Completion> &out, std::string
     }
 
     for(std::size_t i = 0; i < globbuf.gl_pathc; i++) {
-        std::string completion(globbuf.gl_pathv[i]);
-        if(getRidOfFulPathSlashes) {
-            push_prefixed_completion(out, std::move(completion));
-        } else {
-            out.emplace_back(std::move(completion));
-        }
+        out.emplace_back(globbuf.gl_pathv[i]);
     }
 
     globfree(&globbuf);
@@ -51,14 +36,10 @@ static void add_compl_if_matches(std::vector<Replxx::Completion> &out, std::stri
 }
 
 static void complete_command_name_path(std::vector<Replxx::Completion> &out, std::string_view word) {
-    if(std::optional<std::string> path = g.get_variable("PATH")) {
-        utils::Splitter(path.value()).delim(':').for_each([&] (const std::string &dir) -> utils::Splitter::ShouldContinue {
-            std::string glob_path = dir.empty() ? "." : dir;
-            glob_path.push_back('/');
-            glob_path.append(word);
-            complete_word_path(out, glob_path, true);
-            return utils::Splitter::CONTINUE_LOOP;
-        });
+    std::vector<std::string> executables;
+    command_hash::commands_starting_with(word, executables);
+    for(std::string &executable : executables) {
+        out.emplace_back(std::move(executable));
     }
     for(const auto &builtin : *get_builtins()) {
         add_compl_if_matches(out, word, builtin.first);
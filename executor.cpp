@@ -5,9 +5,12 @@
 #include <cassert>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <deque>
+#include <algorithm>
 #include "Tokenizer.h"
 #include "Parser.h"
 #include "Global.h"
@@ -18,12 +21,17 @@
 #include <variant>
 #include "utils.h"
 #include "job_control.h"
+#include "spawn_engine.h"
+#include "bytecode.h"
+#include "ast_cache.h"
 
 namespace executor {
 
-static void run_command_list(const CommandList &cl);
+// `exit_after` means that the process is going to exit right after running the command list.
+// The last external command can then replace the shell with exec() instead of forking first
+static void run_command_list(const CommandList &cl, bool exit_after = false);
 
-static void set_unexpanded_variables(const std::vector<Command::Simple::VariableAssignment> &variable_assignments) {
+static void set_unexpanded_variables(const Command::Simple::VariableAssignments &variable_assignments) {
     for(const Command::Simple::VariableAssignment &va : variable_assignments) {
         std::string value;
         WordExpander::Options opt;
@@ -31,7 +39,7 @@ static void set_unexpanded_variables(const std::vector<Command::Simple::Variable
         opt.fieldSplitting = false;
         opt.pathnameExpansion = WordExpander::Options::NEVER;
         opt.variableAtAsMultipleFields = false;
-        if (!WordExpander(opt, va.value).expand_into(value)) {
+        if (!WordExpander(opt, va.compiled_value, va.value).expand_into(value)) {
             std::cerr << "Failed expansion: was trying to expand variable '" << va.name << "' "
                       << "with value '" << va.value << "'\n";
             g.last_return_value = 1;
@@ -53,7 +61,7 @@ static bool touch_file(const std::string &path, const char *mode) {
     return true;
 }
 
-static bool touch_files(const std::deque<Redirection> &redirections) {
+static bool touch_files(const Redirections &redirections) {
     // TODO: maybe this shouldn't be a special case? Could `>a` be equivallent in
     // results to just `{}>a`?
     for(const Redirection &redir : redirections) {
@@ -70,7 +78,7 @@ static bool touch_files(const std::deque<Redirection> &redirections) {
         opt.fieldSplitting = false;
         opt.pathnameExpansion = WordExpander::Options::ONLY_IF_SINGLE_RESULT;
         opt.variableAtAsMultipleFields = false;
-        if(! WordExpander(opt, redir.path).expand_into(path)) {
+        if(! WordExpander(opt, redir.compiled_path, redir.path).expand_into(path)) {
             std::cerr << "shell: Ambiguous redirect\n";
             return false;
         }
@@ -139,6 +147,9 @@ static std::optional<int> fd_save(int original_fd) {
     }
     // No need to close(original_fd) because dup2 closes the dest fd
 
+    // Commands run while the fd is saved shouldn't inherit the copy
+    fcntl(new_fd, F_SETFD, FD_CLOEXEC);
+
     g.saved_fds.push_back(Global::SavedFd{original_fd, new_fd});
     return { new_fd };
 }
@@ -216,7 +227,7 @@ static bool setup_redirection(const Redirection &redir) {
  * - redirections applied to builtins: `echo $var > file`
  * - redirections to non-pipelined command lists: `{ a; b; } > file`, and other compound commands
  */
-static std::deque<int> setup_redirections_save_old_fds(const std::deque<Redirection> &redirs) {
+static std::deque<int> setup_redirections_save_old_fds(const Redirections &redirs) {
     // The naive approach to handle this would be
     // - save the old fd
     // - open() and move the resulting fd to the old fd
@@ -278,12 +289,59 @@ static std::deque<int> setup_redirections_save_old_fds(const std::deque<Redirect
     return saved_fds;
 }
 
-static void restore_old_fds(const std::deque<int> &old_fds) {
+void restore_old_fds(const std::deque<int> &old_fds) {
     for(int saved_fd : old_fds) {
         fd_restore(saved_fd);
     }
 }
 
+std::optional<std::deque<int>> expand_and_setup_redirections(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
+        fprintf(stderr, "Command expansion failed\n");
+        g.last_return_value = 1;
+        return std::nullopt;
+    }
+
+    return setup_redirections_save_old_fds(redirections);
+}
+
+void expand_for_items(const Command::For &for_command, std::vector<std::string> &expanded_items) {
+    for(std::size_t i = 0; i < for_command.items.size(); i++) {
+        WordExpander::Options opt;
+        opt.commonExpansions = true;
+        opt.fieldSplitting = true;
+        opt.pathnameExpansion = WordExpander::Options::ALWAYS;
+        opt.variableAtAsMultipleFields = true;
+        WordExpander(opt, for_command.compiled_items.at(i), for_command.items[i]).expand_into(expanded_items);
+    }
+}
+
+// Simple commands run in the main process are expanded into buffers kept between runs, so that
+// running the body of a loop again allocates only for the expanded words themselves.
+// There's one buffer per nesting level, as a command can run while another one is being expanded
+// (a command substitution) or is still running (a function)
+class ExpansionBuffer {
+public:
+    ExpansionBuffer() {
+        if(s_depth == s_buffers.size())
+            s_buffers.push_back(std::make_unique<Command>());
+        m_command = s_buffers.at(s_depth++).get();
+    }
+    ~ExpansionBuffer() { s_depth--; }
+
+    ExpansionBuffer(const ExpansionBuffer &) = delete;
+    ExpansionBuffer &operator=(const ExpansionBuffer &) = delete;
+
+    Command &get() { return *m_command; }
+
+private:
+    Command *m_command;
+
+    static inline std::vector<std::unique_ptr<Command>> s_buffers;
+    static inline std::size_t s_depth = 0;
+};
+
 [[noreturn]]
 static void exec_expanded_simple_command(const Command &expanded_command, const bool search_for_builitin_or_function) {
     const Command::Simple &expanded_simple = std::get<Command::Simple>(expanded_command.value);
@@ -313,25 +371,17 @@ static void exec_expanded_simple_command(const Command &expanded_command, const
             // Replace "$@" to function's argv without remembering it, as we will be exiting shortly anyway
             g.argv = expanded_simple.argv;
 
-            // Copy the command list as a function can redefine itself (f() { f() { :; }; })
-            CommandList function_command_list = g.functions.at(expanded_simple.argv.at(0));
-            run_command_list(function_command_list);
+            // Hold a reference, as a function can redefine itself (f() { f() { :; }; })
+            std::shared_ptr<const CommandList> function_body = g.functions.at(expanded_simple.argv.at(0));
+            run_command_list(*function_body, true);
 
             exit(g.last_return_value);
         }
     }
 
-    char **argv = new char*[expanded_simple.argv.size() + 1];
-    for(size_t i = 0; i < expanded_simple.argv.size(); ++i) {
-        argv[i] = strdup(expanded_simple.argv.at(i).c_str());
-    }
-    argv[expanded_simple.argv.size()] = nullptr;
-
     job_control::before_exec_no_pipeline(true);
 
-    execvp(expanded_simple.argv.at(0).c_str(), argv);
-    perror(expanded_simple.argv.at(0).c_str());
-    exit(127);
+    spawn_engine::exec_external_command(expanded_simple.argv); // noreturn
 }
 
 [[noreturn]]
@@ -343,7 +393,7 @@ static void expand_and_exec_empty_command(const Command &cmd) {
 }
 
 [[noreturn]]
-static void expand_and_exec_simple_command(Command cmd) {
+static void expand_and_exec_simple_command(const Command &cmd) {
     const Command::Simple &simple_command = std::get<Command::Simple>(cmd.value);
 
     // `a=b` without any commands
@@ -373,39 +423,41 @@ static void expand_and_exec_simple_command(Command cmd) {
     }
 
     // when we are a part of a multi-command pipeline, every substitution happens in a subshell
-    if(!CommandExpander(&cmd).expand()) {
+    Command expanded;
+    if(!CommandExpander(cmd).expand_into(expanded)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
 
-    exec_expanded_simple_command(cmd, true);
+    exec_expanded_simple_command(expanded, true);
 }
 
 [[noreturn]]
-static void expand_and_exec_brace_group(Command expanded) {
-    // expand redirections:
-    if(!CommandExpander(&expanded).expand()) {
+static void expand_and_exec_brace_group(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
-    for(const Redirection &redir : expanded.redirections) {
+    for(const Redirection &redir : redirections) {
         if(!setup_redirection(redir)) {
             fprintf(stderr, "kish: could not redirect\n");
             exit(1);
         }
     }
-    const Command::BraceGroup &brace_group = std::get<Command::BraceGroup>(expanded.value);
-    run_command_list(brace_group.command_list);
+    const Command::BraceGroup &brace_group = std::get<Command::BraceGroup>(cmd.value);
+    run_command_list(brace_group.command_list, true);
     exit(g.last_return_value);
 }
 
 [[noreturn]]
-static void expand_and_exec_if_command(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void expand_and_exec_if_command(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
-    for(const Redirection &redir : cmd.redirections) {
+    for(const Redirection &redir : redirections) {
         if(!setup_redirection(redir)) {
             fprintf(stderr, "kish: could not redirect\n");
             exit(1);
@@ -420,7 +472,7 @@ static void expand_and_exec_if_command(Command cmd) {
     g.last_return_value = 0; // if false; then :; fi  <-  should reset $? to 0
 
     if(condition_return_value == 0) {
-        run_command_list(if_command.then);
+        run_command_list(if_command.then, true);
     } else {
         for(const auto &elif : if_command.elif) {
             g.last_return_value = 0;
@@ -429,24 +481,25 @@ static void expand_and_exec_if_command(Command cmd) {
             g.last_return_value = 0;
 
             if(condition_return_value == 0) {
-                run_command_list(elif.then);
+                run_command_list(elif.then, true);
                 exit(g.last_return_value);
             }
         }
         if(if_command.opt_else.has_value())
-            run_command_list(if_command.opt_else.value());
+            run_command_list(if_command.opt_else.value(), true);
     }
 
     exit(g.last_return_value);
 }
 
 [[noreturn]]
-static void expand_and_exec_while_command(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void expand_and_exec_while_command(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
-    for(const Redirection &redir : cmd.redirections) {
+    for(const Redirection &redir : redirections) {
         if(!setup_redirection(redir)) {
             fprintf(stderr, "kish: could not redirect\n");
             exit(1);
@@ -467,12 +520,13 @@ static void expand_and_exec_while_command(Command cmd) {
 }
 
 [[noreturn]]
-static void expand_and_exec_until_command(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void expand_and_exec_until_command(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
-    for(const Redirection &redir : cmd.redirections) {
+    for(const Redirection &redir : redirections) {
         if(!setup_redirection(redir)) {
             fprintf(stderr, "kish: could not redirect\n");
             exit(1);
@@ -495,12 +549,13 @@ static void expand_and_exec_until_command(Command cmd) {
 }
 
 [[noreturn]]
-static void expand_and_exec_for_command(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void expand_and_exec_for_command(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
-    for(const Redirection &redir : cmd.redirections) {
+    for(const Redirection &redir : redirections) {
         if(!setup_redirection(redir)) {
             fprintf(stderr, "kish: could not redirect\n");
             exit(1);
@@ -510,14 +565,7 @@ static void expand_and_exec_for_command(Command cmd) {
     const Command::For &for_command = std::get<Command::For>(cmd.value);
 
     std::vector<std::string> expanded_items;
-    for(const std::string &item : for_command.items) {
-        WordExpander::Options opt;
-        opt.commonExpansions = true;
-        opt.fieldSplitting = true;
-        opt.pathnameExpansion = WordExpander::Options::ALWAYS;
-        opt.variableAtAsMultipleFields = true;
-        WordExpander(opt, item).expand_into(expanded_items);
-    }
+    expand_for_items(for_command, expanded_items);
 
     // Note: for loops should not create a new scope for the looped-over variable
     // `for x in 1 2 3; do :; done; echo $x` -> 3
@@ -534,8 +582,9 @@ static void expand_and_exec_for_command(Command cmd) {
 
 // f() { :; } | g() { :; }
 [[noreturn]]
-static void expand_and_exec_function_definition_command(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void expand_and_exec_function_definition_command(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         exit(1);
     }
@@ -545,28 +594,65 @@ static void expand_and_exec_function_definition_command(Command cmd) {
     exit(0);
 }
 
-// Runs a pipelined command
-static std::optional<pid_t> run_command_expand_in_subprocess(const Command &cmd) {
-    // TODO: better job control here
-    int pid = job_control::fork_own_process_group();
+// How a single pipeline stage is connected to its neighbours: `left | stage | right`.
+// Planned separately from the commands, so that the AST doesn't have to be copied to launch a pipeline
+struct PipelineStageFds {
+    int stdin_fd = -1; // read end of the pipe from the previous stage
+    int stdout_fd = -1; // write end of the pipe to the next stage
+    int next_stdin_fd = -1; // read end for the next stage, not to be kept open by this one
+};
+
+static bool create_pipe_cloexec(int pipefd[2]) {
+#ifdef __linux__
+    return pipe2(pipefd, O_CLOEXEC) == 0;
+#else
+    if(pipe(pipefd) == -1)
+        return false;
+    fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+
+// In a forked pipeline stage: move the pipe ends to stdin and stdout, before the command's own redirections
+static void wire_pipeline_stage(const PipelineStageFds &stage) {
+    if(stage.next_stdin_fd != -1)
+        close(stage.next_stdin_fd);
+
+    if(stage.stdin_fd != -1) {
+        if(!setup_rewiring({ Redirection::Rewiring, STDIN_FILENO, stage.stdin_fd }))
+            exit(1);
+        close(stage.stdin_fd);
+    }
+    if(stage.stdout_fd != -1) {
+        if(!setup_rewiring({ Redirection::Rewiring, STDOUT_FILENO, stage.stdout_fd }))
+            exit(1);
+        close(stage.stdout_fd);
+    }
+}
+
+// Runs a pipelined command. All the commands of a pipeline share the process group `pgid`, 0 for the first one
+static std::optional<pid_t> run_command_expand_in_subprocess(const Command &cmd, const PipelineStageFds &stage, pid_t pgid) {
+    int pid = job_control::fork_into_process_group(pgid, true);
     if(pid == -1) {
         perror("fork");
         return {};
     }
     if(pid == 0) {
+        wire_pipeline_stage(stage);
 
         // TODO: make CommandExpander run here, instead of in expand_and_exec_*_command(cmd)
         // Would that work?
 
         std::visit(utils::overloaded {
-              [&] (const Command::Empty) { expand_and_exec_empty_command(cmd); },
-              [&] (const Command::Simple) { expand_and_exec_simple_command(cmd); },
-              [&] (const Command::BraceGroup) { expand_and_exec_brace_group(cmd); },
-              [&] (const Command::If) { expand_and_exec_if_command(cmd); },
-              [&] (const Command::While) { expand_and_exec_while_command(cmd); },
-              [&] (const Command::Until) { expand_and_exec_until_command(cmd); },
-              [&] (const Command::For) { expand_and_exec_for_command(cmd); },
-              [&] (const Command::FunctionDefinition) { expand_and_exec_function_definition_command(cmd); },
+              [&] (const Command::Empty &) { expand_and_exec_empty_command(cmd); },
+              [&] (const Command::Simple &) { expand_and_exec_simple_command(cmd); },
+              [&] (const Command::BraceGroup &) { expand_and_exec_brace_group(cmd); },
+              [&] (const Command::If &) { expand_and_exec_if_command(cmd); },
+              [&] (const Command::While &) { expand_and_exec_while_command(cmd); },
+              [&] (const Command::Until &) { expand_and_exec_until_command(cmd); },
+              [&] (const Command::For &) { expand_and_exec_for_command(cmd); },
+              [&] (const Command::FunctionDefinition &) { expand_and_exec_function_definition_command(cmd); },
         }, cmd.value);
     }
     return { pid };
@@ -587,7 +673,7 @@ static void run_builitin_in_main_process(BuiltinHandler &builtin, const Command
 }
 
 // Runs a non-pipelined shell function with possible redirections
-static void run_function_in_main_process(const Command &expanded_command) {
+static void run_function_in_main_process(const Command &expanded_command, bool exit_after) {
     const auto &simple_command = std::get<Command::Simple>(expanded_command.value);
 
     /* TODO: handle inline environment variables */
@@ -603,10 +689,13 @@ static void run_function_in_main_process(const Command &expanded_command) {
     std::vector<std::string> old_argv{std::move(g.argv)};
     g.argv = simple_command.argv;
 
-    // Make a copy, as a function can modify itself while running (f() { f() { :; }; })
-    CommandList command_list = g.functions.at(simple_command.argv.at(0));
+    // Keep the body alive, as a function can redefine itself while running (f() { f() { :; }; })
+    std::shared_ptr<const CommandList> function_body = g.functions.at(simple_command.argv.at(0));
 
-    run_command_list(command_list);
+    if(g.options.bytecode)
+        bytecode::run_function(function_body, exit_after);
+    else
+        run_command_list(*function_body, exit_after);
 
     // Restore "$@"
     g.argv = std::move(old_argv);
@@ -615,7 +704,7 @@ static void run_function_in_main_process(const Command &expanded_command) {
 }
 
 // Runs non-pipelined commands composed of only redirections
-static void run_empty_command_expand_in_main_process(const Command &cmd) {
+void run_empty_command_expand_in_main_process(const Command &cmd) {
     // `>file` with no commands
     if(!touch_files(cmd.redirections))
         g.last_return_value = 1;
@@ -648,9 +737,48 @@ static void run_empty_simple_command_expand_in_main_process(const Command &cmd)
     }
 }
 
+void run_external_command(const Command &expanded_command) {
+    // posix_spawn doesn't have to duplicate the address space of the shell, unlike fork()
+    std::optional<pid_t> pid = spawn_engine::spawn_expanded_simple_command(expanded_command);
+    if(!pid) {
+        // Spawning failed (or isn't possible here) - go through fork() + exec(), which
+        // also reports errors like missing commands or unopenable redirections
+        pid = job_control::fork_own_process_group();
+        if(pid == -1) {
+            perror("fork");
+            return;
+        }
+        if(pid == 0) {
+            // child
+            exec_expanded_simple_command(expanded_command, false); // noreturn
+        }
+    }
+    job_control::wait_for_one(pid.value());
+}
+
+void exec_simple_command(const Command &expanded_command) {
+    exec_expanded_simple_command(expanded_command, true);
+}
+
+// Replaces the shell with an external command that would otherwise be the last thing the shell runs
+[[noreturn]]
+static void tail_exec_external_command(const Command &expanded_command) {
+    // Exported, so that it's possible to see if this works: `kish -c 'printenv KISH_FORKS_AVOIDED'`.
+    // Inherited across nested shells, so the count grows with every replaced process
+    const char *forks_avoided = getenv("KISH_FORKS_AVOIDED");
+    setenv("KISH_FORKS_AVOIDED", std::to_string(atoll(forks_avoided ? forks_avoided : "0") + 1).c_str(), 1);
+
+    // Anything still buffered would be lost by exec()
+    fflush(nullptr);
+
+    exec_expanded_simple_command(expanded_command, false);
+}
+
 // Runs non-pipelined simple commands (e.g. `a=b c d >e`) that have argv in them
-static void run_nonempty_simple_command_expand_in_main_process(Command expanded) {
-    if(!CommandExpander(&expanded).expand()) {
+static void run_nonempty_simple_command_expand_in_main_process(const Command &cmd, bool exit_after) {
+    ExpansionBuffer buffer;
+    Command &expanded = buffer.get();
+    if(!CommandExpander(cmd).expand_into(expanded)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -664,24 +792,16 @@ static void run_nonempty_simple_command_expand_in_main_process(Command expanded)
     } else if(g.functions.contains(expanded_simple_command.argv.at(0))) {
         /* TODO: inline environment variables should expand to environment variables here */
         /* and return back to their state */
-        run_function_in_main_process(expanded);
+        run_function_in_main_process(expanded, exit_after);
+    } else if(exit_after) {
+        tail_exec_external_command(expanded); // noreturn
     } else {
-        int pid = job_control::fork_own_process_group();
-        if(pid == -1) {
-            perror("fork");
-            return;
-        }
-        if(pid == 0) {
-            // child
-            exec_expanded_simple_command(expanded, false); // noreturn
-        }
-        job_control::wait_for_one(pid);
-   }
-
+        run_external_command(expanded);
+    }
 }
 
 // Runs non-pipelined simple commands (e.g. `a=b c d >e`)
-static void run_simple_command_expand_in_main_process(const Command &cmd) {
+void run_simple_command_expand_in_main_process(const Command &cmd, bool exit_after) {
     const Command::Simple &simple_command = std::get<Command::Simple>(cmd.value);
 
     // TODO:
@@ -694,12 +814,13 @@ static void run_simple_command_expand_in_main_process(const Command &cmd) {
     if(simple_command.argv.size() == 0)
         run_empty_simple_command_expand_in_main_process(cmd);
     else
-        run_nonempty_simple_command_expand_in_main_process(cmd);
+        run_nonempty_simple_command_expand_in_main_process(cmd, exit_after);
 }
 
 // Runs non-pipelined brace groups (e.g `{ a; b; } > c`)
-static void run_brace_group_expand_in_main_process(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void run_brace_group_expand_in_main_process(const Command &cmd, bool exit_after) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -707,15 +828,16 @@ static void run_brace_group_expand_in_main_process(Command cmd) {
 
     const Command::BraceGroup &brace_group = std::get<Command::BraceGroup>(cmd.value);
 
-    auto saved_fds = setup_redirections_save_old_fds(cmd.redirections);
+    auto saved_fds = setup_redirections_save_old_fds(redirections);
 
-    run_command_list(brace_group.command_list);
+    run_command_list(brace_group.command_list, exit_after);
 
     restore_old_fds(saved_fds);
 }
 
-static void run_if_command_expand_in_main_process(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void run_if_command_expand_in_main_process(const Command &cmd, bool exit_after) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -723,7 +845,7 @@ static void run_if_command_expand_in_main_process(Command cmd) {
 
     const Command::If &if_command = std::get<Command::If>(cmd.value);
 
-    auto saved_fds = setup_redirections_save_old_fds(cmd.redirections);
+    auto saved_fds = setup_redirections_save_old_fds(redirections);
 
     g.last_return_value = 0; // if ; ; then ...  <-  should not depend on $?
     run_command_list(if_command.condition);
@@ -733,7 +855,7 @@ static void run_if_command_expand_in_main_process(Command cmd) {
     g.last_return_value = 0; // if false; then :; fi  <-  should reset $? to 0
 
     if(condition_return_value == 0) {
-        run_command_list(if_command.then);
+        run_command_list(if_command.then, exit_after);
     } else {
         for(const auto &elif : if_command.elif) {
             g.last_return_value = 0;
@@ -742,21 +864,22 @@ static void run_if_command_expand_in_main_process(Command cmd) {
             g.last_return_value = 0;
 
             if(condition_return_value == 0) {
-                run_command_list(elif.then);
+                run_command_list(elif.then, exit_after);
 
                 restore_old_fds(saved_fds);
                 return;
             }
         }
         if(if_command.opt_else.has_value())
-            run_command_list(if_command.opt_else.value());
+            run_command_list(if_command.opt_else.value(), exit_after);
     }
 
     restore_old_fds(saved_fds);
 }
 
-static void run_while_command_expand_in_main_process(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void run_while_command_expand_in_main_process(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -764,7 +887,7 @@ static void run_while_command_expand_in_main_process(Command cmd) {
 
     const Command::While &while_command = std::get<Command::While>(cmd.value);
 
-    auto saved_fds = setup_redirections_save_old_fds(cmd.redirections);
+    auto saved_fds = setup_redirections_save_old_fds(redirections);
 
     while(true) {
         g.last_return_value = 0;
@@ -781,8 +904,9 @@ static void run_while_command_expand_in_main_process(Command cmd) {
     }
 }
 
-static void run_until_command_expand_in_main_process(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void run_until_command_expand_in_main_process(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -790,7 +914,7 @@ static void run_until_command_expand_in_main_process(Command cmd) {
 
     const Command::Until &until_command = std::get<Command::Until>(cmd.value);
 
-    auto saved_fds = setup_redirections_save_old_fds(cmd.redirections);
+    auto saved_fds = setup_redirections_save_old_fds(redirections);
 
     while(true) {
         g.last_return_value = 0;
@@ -807,8 +931,9 @@ static void run_until_command_expand_in_main_process(Command cmd) {
     }
 }
 
-static void run_for_command_expand_in_main_process(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+static void run_for_command_expand_in_main_process(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -817,14 +942,7 @@ static void run_for_command_expand_in_main_process(Command cmd) {
     const Command::For &for_command = std::get<Command::For>(cmd.value);
 
     std::vector<std::string> expanded_items;
-    for(const std::string &item : for_command.items) {
-        WordExpander::Options opt;
-        opt.commonExpansions = true;
-        opt.fieldSplitting = true;
-        opt.pathnameExpansion = WordExpander::Options::ALWAYS;
-        opt.variableAtAsMultipleFields = true;
-        WordExpander(opt, item).expand_into(expanded_items);
-    }
+    expand_for_items(for_command, expanded_items);
 
     // Note: for loops should not create a new scope for the looped-over variable
     // `for x in 1 2 3; do :; done; echo $x` -> 3
@@ -837,8 +955,24 @@ static void run_for_command_expand_in_main_process(Command cmd) {
     }
 }
 
-static void run_function_definition_command_expand_in_main_process(Command cmd) {
-    if(!CommandExpander(&cmd).expand()) {
+// Function definitions replaced while running an in-process command substitution,
+// so they can be put back afterwards without copying the whole function table up front
+static std::vector<std::pair<std::string, std::shared_ptr<const CommandList>>> *replaced_functions = nullptr;
+
+static void remember_replaced_function(const std::string &name) {
+    if(replaced_functions == nullptr)
+        return;
+
+    auto found = g.functions.find(name);
+    if(found == g.functions.end())
+        replaced_functions->emplace_back(name, nullptr);
+    else
+        replaced_functions->emplace_back(name, found->second);
+}
+
+void run_function_definition_command_expand_in_main_process(const Command &cmd) {
+    Redirections redirections;
+    if(!CommandExpander(cmd).expand_redirections_into(redirections)) {
         fprintf(stderr, "Command expansion failed\n");
         g.last_return_value = 1;
         return;
@@ -846,6 +980,7 @@ static void run_function_definition_command_expand_in_main_process(Command cmd)
 
     const Command::FunctionDefinition &function_definition_command = std::get<Command::FunctionDefinition>(cmd.value);
 
+    remember_replaced_function(function_definition_command.name);
     g.functions[function_definition_command.name] = function_definition_command.body;
 
     /* TODO */
@@ -853,68 +988,81 @@ static void run_function_definition_command_expand_in_main_process(Command cmd)
 }
 
 // Runs any non-pipelined command
-static void run_command_expand_in_main_process(const Command &cmd) {
+static void run_command_expand_in_main_process(const Command &cmd, bool exit_after) {
     std::visit(utils::overloaded {
-          [&] (const Command::Empty) { run_empty_command_expand_in_main_process(cmd); },
-          [&] (const Command::Simple) { run_simple_command_expand_in_main_process(cmd); },
-          [&] (const Command::BraceGroup) { run_brace_group_expand_in_main_process(cmd); },
-          [&] (const Command::If) { run_if_command_expand_in_main_process(cmd); },
-          [&] (const Command::While) { run_while_command_expand_in_main_process(cmd); },
-          [&] (const Command::Until) { run_until_command_expand_in_main_process(cmd); },
-          [&] (const Command::For) { run_for_command_expand_in_main_process(cmd); },
-          [&] (const Command::FunctionDefinition) { run_function_definition_command_expand_in_main_process(cmd); },
+          [&] (const Command::Empty &) { run_empty_command_expand_in_main_process(cmd); },
+          [&] (const Command::Simple &) { run_simple_command_expand_in_main_process(cmd, exit_after); },
+          [&] (const Command::BraceGroup &) { run_brace_group_expand_in_main_process(cmd, exit_after); },
+          [&] (const Command::If &) { run_if_command_expand_in_main_process(cmd, exit_after); },
+          [&] (const Command::While &) { run_while_command_expand_in_main_process(cmd); },
+          [&] (const Command::Until &) { run_until_command_expand_in_main_process(cmd); },
+          [&] (const Command::For &) { run_for_command_expand_in_main_process(cmd); },
+          [&] (const Command::FunctionDefinition &) { run_function_definition_command_expand_in_main_process(cmd); },
     }, cmd.value);
 }
 
-// Setup pipe between two commands: `left | right`
-static void setup_pipe_between(Command &left, Command &right) {
-    int pipefd[2];
-    if(pipe(pipefd) == -1) {
-        perror("pipe");
-        return;
-    }
-    left.redirections.push_front(Redirection{Redirection::Rewiring, STDOUT_FILENO, pipefd[1]});
-    right.redirections.push_front(Redirection{Redirection::Rewiring, STDIN_FILENO, pipefd[0]});
-
-    // TODO: Should this be a `push_front` or a `push_back`? Does the order here even matter?
-    left.pipe_file_descriptors.push_front(pipefd[1]);
-    right.pipe_file_descriptors.push_front(pipefd[0]);
-}
-
 // Runs a multi-command pipeline, for example: `a | b | c`
-static void run_multi_command_pipeline(const Pipeline &pipeline) {
-    std::vector<int> fds;
-    Pipeline modified = pipeline;
-
+void run_multi_command_pipeline(const Pipeline &pipeline) {
     std::vector<pid_t> pids;
-    for(size_t i = 0; i < modified.commands.size(); ++i) {
-        Command &cmd = modified.commands[i];
-        if(i != modified.commands.size() - 1) {
-            Command &next = modified.commands[i + 1];
-            setup_pipe_between(cmd, next);
+    pids.reserve(pipeline.commands.size());
+
+    int previous_stdout_read_end = -1;
+    for(size_t i = 0; i < pipeline.commands.size(); ++i) {
+        PipelineStageFds stage;
+        stage.stdin_fd = previous_stdout_read_end;
+
+        if(i != pipeline.commands.size() - 1) {
+            int pipefd[2];
+            if(create_pipe_cloexec(pipefd)) {
+                stage.stdout_fd = pipefd[1];
+                stage.next_stdin_fd = pipefd[0];
+            } else {
+                perror("pipe");
+            }
         }
 
-        auto maybe_pid = run_command_expand_in_subprocess(cmd);
+        auto maybe_pid = run_command_expand_in_subprocess(pipeline.commands[i], stage, pids.empty() ? 0 : pids.front());
 
-        for(int fd : cmd.pipe_file_descriptors)
-            close(fd); // ignore errors
+        // ignore errors
+        if(stage.stdin_fd != -1)
+            close(stage.stdin_fd);
+        if(stage.stdout_fd != -1)
+            close(stage.stdout_fd);
+        previous_stdout_read_end = stage.next_stdin_fd;
 
         if(maybe_pid)
             pids.push_back(maybe_pid.value());
     }
 
-    job_control::wait_for_all(pids);
+    job_control::wait_for_all(pids, g.pipestatus);
+
+    // $? of a pipeline is the exit status of its last command - or with pipefail,
+    // of the last one that failed
+    g.last_return_value = g.pipestatus.empty() ? 1 : g.pipestatus.back();
+    if(g.options.pipefail) {
+        auto last_failed = std::find_if(g.pipestatus.rbegin(), g.pipestatus.rend(), [](int status) {
+            return status != 0;
+        });
+        if(last_failed != g.pipestatus.rend())
+            g.last_return_value = *last_failed;
+    }
 }
 
-static void run_single_command_pipeline(const Command &command) {
-    run_command_expand_in_main_process(command);
+static void run_single_command_pipeline(const Command &command, bool exit_after) {
+    run_command_expand_in_main_process(command, exit_after);
 }
 
-static void run_pipeline(const Pipeline &pipeline) {
+static void run_pipeline(const Pipeline &pipeline, bool exit_after) {
     if(pipeline.commands.size() == 0) {
         g.last_return_value = 0;
     } else if(pipeline.commands.size() == 1) {
-        run_single_command_pipeline(pipeline.commands.at(0));
+        // `! cmd` still has to negate the return value after `cmd` finishes
+        run_single_command_pipeline(pipeline.commands.at(0), exit_after && !pipeline.negation_prefix);
+
+        // Compound commands leave the statuses of the last pipeline they ran, like in bash
+        const auto &value = pipeline.commands.at(0).value;
+        if(std::holds_alternative<Command::Simple>(value) || std::holds_alternative<Command::Empty>(value))
+            g.pipestatus.assign(1, g.last_return_value);
     } else if(pipeline.commands.size() > 1) {
         run_multi_command_pipeline(pipeline);
     }
@@ -923,9 +1071,9 @@ static void run_pipeline(const Pipeline &pipeline) {
         g.last_return_value = !g.last_return_value;
 }
 
-static void run_and_or_list(const AndOrList &and_or_list) {
+static void run_and_or_list(const AndOrList &and_or_list, bool exit_after) {
     for(const WithFollowingOperator<Pipeline> &pipe_op : and_or_list) {
-        run_pipeline(pipe_op.val);
+        run_pipeline(pipe_op.val, exit_after && &pipe_op == &and_or_list.back());
 
         if(pipe_op.following_operator == "&&" && g.last_return_value != 0)
             return;
@@ -934,42 +1082,407 @@ static void run_and_or_list(const AndOrList &and_or_list) {
     }
 }
 
-static void run_command_list(const CommandList &cl) {
+// Runs an asynchronous list: `a && b &`
+void run_and_or_list_in_background(const AndOrList &and_or_list) {
+    pid_t pid = job_control::fork_into_process_group(0, false);
+    if(pid == -1) {
+        perror("fork");
+        g.last_return_value = 1;
+        return;
+    }
+    if(pid == 0) {
+        job_control::become_background_job();
+        run_and_or_list(and_or_list, true);
+        exit(g.last_return_value);
+    }
+
+    job_control::add_background_job(pid);
+    g.last_background_pid = pid;
+    g.last_return_value = 0;
+}
+
+static void run_command_list(const CommandList &cl, bool exit_after) {
     for(const WithFollowingOperator<AndOrList> &aol_op : cl) {
-        run_and_or_list(aol_op.val);
-        // aol_and_op.following_operator is ";" or "" or "&" (TODO)
+        // aol_and_op.following_operator is ";" or "" or "&"
+        if(aol_op.following_operator == "&")
+            run_and_or_list_in_background(aol_op.val);
+        else
+            run_and_or_list(aol_op.val, exit_after && &aol_op == &cl.back());
     }
 }
 
-void run_from_string(const std::string &str) {
+static void run_parsed(const CommandList &parsed, bool exit_after) {
+    if(g.options.bytecode)
+        bytecode::run(bytecode::compile(parsed, exit_after));
+    else
+        run_command_list(parsed, exit_after);
+}
+
+// What's done with each command of a script as soon as it's parsed: it's run, or only stored in the AST cache.
+// `last` is set for the command that ends the script
+using CommandHandler = std::function<void(const CommandList &parsed, bool last)>;
+
+static CommandHandler run_each(bool exit_after) {
+    return [exit_after](const CommandList &parsed, bool last) {
+        run_parsed(parsed, exit_after && last);
+    };
+}
+
+// Tokenizes and parses all of `str` before handing it over. Returns false after a syntax error
+static bool parse_whole_string(std::string_view str, const CommandHandler &handle) {
     std::vector<Token> tokens;
     try {
         tokens = Tokenizer(str).tokenize();
     } catch(const Tokenizer::SyntaxError &se) {
         std::cerr << "Syntax error: " << se.explanation << "\n";
         g.last_return_value = 1;
-        return;
+        return false;
     }
 
 //    for(const Token &token : tokens) {
 //        std::cerr << "[" << token.value << "]" << (token.type == Token::Type::OPERATOR ? " (op)\n" : "\n");
 //    }
 
-    CommandList parsed;
+    std::pmr::monotonic_buffer_resource arena;
+    CommandList parsed(&arena);
 
     try {
-        parsed = Parser(tokens).parse();
+        parsed = Parser(tokens, &arena).parse();
     } catch(const Parser::SyntaxError &se) {
         std::cerr << "Syntax error: " << se.explanation << "\n";
         g.last_return_value = 1;
-        return;
+        return false;
     }
 
-    run_command_list(parsed);
+    handle(parsed, true);
+    return true;
+}
+
+// Hands over the complete commands (see Parser::parse_complete_command()) at the start of `text`, each one as soon as it's parsed.
+// Returns how much of `text` they took up - what's left is an unfinished command - or nullopt after a syntax error.
+// `at_end` means that nothing more comes after `text`
+static std::optional<size_t> parse_complete_commands(std::string_view text, bool at_end, const CommandHandler &handle) {
+    // The unfinished command at the end is tokenized again once there's more of it, so it isn't an error yet
+    std::vector<Token> tokens = Tokenizer(text).dontThrowOnIncompleteInput().tokenize();
+
+    size_t token_i = 0;
+    size_t ran_until = 0;
+    while(token_i < tokens.size()) {
+        // Each command gets an arena of its own, so the memory used stays the same however long the script is
+        std::pmr::monotonic_buffer_resource arena;
+        std::optional<CommandList> parsed;
+
+        try {
+            Parser parser(tcb::span<const Token>(tokens).subspan(token_i), &arena);
+            parsed = parser.parse_complete_command();
+            token_i += parser.consumed_tokens();
+        } catch(const Parser::SyntaxError &se) {
+            if(se.end_of_input)
+                break;
+
+            std::cerr << "Syntax error: " << se.explanation << "\n";
+            g.last_return_value = 1;
+            return std::nullopt;
+        }
+
+        if(!parsed)
+            break;
+
+        // The command ends with a newline token
+        ran_until = static_cast<size_t>(tokens[token_i - 1].positionEnd);
+        handle(parsed.value(), at_end && token_i == tokens.size());
+    }
+
+    return ran_until;
+}
+
+void run_from_string(const std::string &str, bool exit_after) {
+    std::optional<size_t> ran_until = parse_complete_commands(str, true, run_each(exit_after));
+
+    // The last command if it doesn't end with a newline, or a syntax error to report
+    if(ran_until && ran_until.value() < str.size())
+        parse_whole_string(std::string_view(str).substr(ran_until.value()), run_each(exit_after));
+}
+
+// How much of a script is tokenized at once: big enough to take few reads,
+// small enough to start running a script right away
+static constexpr size_t script_chunk_size = 8 * 1024;
+
+// Reads and runs commands from `fd` until its end. Only the command being run and what's read after it are kept in memory
+static void run_from_fd(int fd, bool exit_after) {
+    std::string text; // read, but not run yet
+    bool at_end = false;
+    while(!at_end) {
+        // An unfinished command is tokenized again after every read - reading at least as much again
+        // as there already is of it keeps that linear in its length
+        size_t read_size = std::max(script_chunk_size, text.size());
+        size_t old_size = text.size();
+        text.resize(old_size + read_size);
+
+        ssize_t got;
+        do {
+            got = read(fd, text.data() + old_size, read_size);
+        } while(got == -1 && errno == EINTR);
+        if(got == -1) {
+            perror("kish: read");
+            got = 0;
+        }
+
+        text.resize(old_size + static_cast<size_t>(got));
+        at_end = got == 0;
+
+        // Only whole lines can hold complete commands
+        size_t lines_end = at_end ? text.size() : text.rfind('\n') + 1; // npos + 1 == 0
+        std::optional<size_t> ran_until = parse_complete_commands(std::string_view(text).substr(0, lines_end), at_end, run_each(exit_after));
+        if(!ran_until)
+            return;
+
+        text.erase(0, ran_until.value());
+    }
+
+    if(!text.empty())
+        parse_whole_string(text, run_each(exit_after));
+}
+
+// Parses a memory-mapped script a chunk of lines at a time, straight from the mapping,
+// handing over each of its commands as soon as it's parsed. Returns false after a syntax error
+static bool parse_mapped_script(std::string_view script, const CommandHandler &handle) {
+    size_t begin = 0;
+    size_t chunk_size = script_chunk_size;
+    while(begin < script.size()) {
+        std::string_view rest = script.substr(begin);
+        bool at_end = chunk_size >= rest.size();
+
+        // Only whole lines can hold complete commands
+        std::string_view lines = at_end ? rest : rest.substr(0, rest.rfind('\n', chunk_size - 1) + 1); // npos + 1 == 0
+        std::optional<size_t> ran_until = parse_complete_commands(lines, at_end, handle);
+        if(!ran_until)
+            return false;
+
+        begin += ran_until.value();
+        if(at_end) {
+            // The last command if it doesn't end with a newline, or a syntax error to report
+            return begin == script.size() || parse_whole_string(script.substr(begin), handle);
+        }
+
+        // A command longer than a chunk: take in as much again, to stay linear in its length
+        chunk_size = ran_until.value() == 0 ? chunk_size * 2 : script_chunk_size;
+    }
+
+    return true;
+}
+
+// A regular file, mapped read-only for as long as this lives
+class MappedFile {
+public:
+    MappedFile(int fd, size_t size)
+        : m_size(size)
+        , m_mapping(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0))
+    {
+        if(m_mapping != MAP_FAILED)
+            madvise(m_mapping, m_size, MADV_SEQUENTIAL);
+    }
+    ~MappedFile() {
+        if(m_mapping != MAP_FAILED)
+            munmap(m_mapping, m_size);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    explicit operator bool() const { return m_mapping != MAP_FAILED; }
+    std::string_view contents() const { return std::string_view(static_cast<const char *>(m_mapping), m_size); }
+private:
+    size_t m_size;
+    void *m_mapping;
+};
+
+// Runs the commands of a script from its AST cache entry. Returns false if it has none, without running anything
+static bool run_cached_script(const ast_cache::Key &key, bool exit_after) {
+    ast_cache::Reader reader(key);
+    if(!reader)
+        return false;
+
+    try {
+        while(!reader.at_end()) {
+            std::pmr::monotonic_buffer_resource arena;
+            CommandList parsed = reader.next(&arena);
+            run_parsed(parsed, exit_after && reader.at_end());
+        }
+    } catch(const ast_cache::Reader::Damaged &) {
+        std::cerr << "kish: The cached commands of '" << key.path << "' are damaged\n";
+        g.last_return_value = 1;
+    }
+
+    return true;
+}
+
+// Runs a mapped script from the AST cache, or parses it, storing it in the cache if it's big enough.
+// Returns false after a syntax error
+static bool run_mapped_script(const std::string &path, const struct stat &st, std::string_view script, bool exit_after) {
+    std::optional<ast_cache::Key> key;
+    if(script.size() >= ast_cache::min_cached_size)
+        key = ast_cache::key_for(path, st, script);
+    if(!key)
+        return parse_mapped_script(script, run_each(exit_after));
+
+    if(run_cached_script(key.value(), exit_after))
+        return true;
+
+    ast_cache::Writer cache(std::move(key.value()));
+    bool parsed = parse_mapped_script(script, [&](const CommandList &parsed, bool last) {
+        cache.add(parsed);
+        // Before the last command runs, as it might replace the shell process
+        if(last)
+            cache.commit();
+        run_parsed(parsed, exit_after && last);
+    });
+
+    // Scripts ending with comments have no last command
+    if(parsed)
+        cache.commit();
+    return parsed;
+}
+
+bool run_from_file(const std::string &path, bool exit_after) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return false;
+
+    // Out of the way of the fds that redirections use and save (see get_unused_fd()), like bash does
+    int high_fd = fcntl(fd, F_DUPFD_CLOEXEC, 255);
+    if(high_fd != -1) {
+        close(fd);
+        fd = high_fd;
+    }
+
+    // Regular files are mapped instead of being copied into a buffer.
+    // Anything that the script appended to itself while it ran is read normally afterwards
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = static_cast<size_t>(st.st_size);
+        std::optional<bool> parsed;
+        if(MappedFile mapped(fd, size); mapped)
+            parsed = run_mapped_script(path, st, mapped.contents(), exit_after);
+
+        if(parsed && (!parsed.value() || lseek(fd, static_cast<off_t>(size), SEEK_SET) == -1)) {
+            close(fd);
+            return true;
+        }
+    }
+
+    // Pipes and special files (`kish /dev/stdin`)
+    run_from_fd(fd, exit_after);
+    close(fd);
+    return true;
+}
+
+bool compile_file(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return false;
+
+    struct stat st {};
+    if(fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        int error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        close(fd);
+        errno = error;
+        return false;
+    }
+
+    g.last_return_value = 0;
+    size_t size = static_cast<size_t>(st.st_size);
+    MappedFile mapped(fd, size);
+    close(fd);
+
+    // Small scripts are never looked up in the cache (see run_mapped_script())
+    if(size < ast_cache::min_cached_size)
+        return true;
+
+    std::optional<ast_cache::Key> key;
+    if(mapped)
+        key = ast_cache::key_for(path, st, mapped.contents());
+
+    bool stored = false;
+    if(key) {
+        ast_cache::Writer cache(std::move(key.value()));
+        bool parsed = parse_mapped_script(mapped.contents(), [&](const CommandList &parsed, bool) {
+            cache.add(parsed);
+        });
+        if(!parsed)
+            return true;
+        stored = cache.commit();
+    }
+
+    if(!stored) {
+        std::cerr << "kish: Cannot store the parsed commands of '" << path << "' in the cache\n";
+        g.last_return_value = 1;
+    }
+    return true;
+}
+
+void check_syntax(const std::string &str) {
+    g.last_return_value = 0;
+    try {
+        std::vector<Token> tokens = Tokenizer(str).tokenize();
+        std::pmr::monotonic_buffer_resource arena;
+        Parser(tokens, &arena).parse();
+    } catch(const Tokenizer::SyntaxError &se) {
+        std::cerr << "Syntax error: " << se.explanation << "\n";
+        g.last_return_value = 1;
+    } catch(const Parser::SyntaxError &se) {
+        std::cerr << "Syntax error: " << se.explanation << "\n";
+        g.last_return_value = 1;
+    }
+}
+
+// Reads everything from the pipe, directly into the free space at the end of `out`.
+// The free space grows geometrically, so a large capture takes few reads and few reallocations
+static void read_capture_pipe(int fd, std::string &out) {
+    static constexpr size_t initial_chunk = 16 * 1024;
+#ifdef F_SETPIPE_SZ
+    static constexpr size_t large_capture = 64 * 1024;
+    static constexpr int large_pipe_size = 1024 * 1024;
+    bool pipe_enlarged = false;
+#endif
+
+    size_t old_size = out.size();
+    size_t used = old_size;
+    size_t chunk = initial_chunk;
+
+    for(;;) {
+        if(out.size() - used < chunk / 2)
+            out.resize(used + chunk);
+
+        ssize_t nread = read(fd, out.data() + used, out.size() - used);
+        if(nread == -1 && errno == EINTR)
+            continue;
+        if(nread <= 0)
+            break;
+        used += static_cast<size_t>(nread);
+
+        if(used - old_size >= chunk)
+            chunk *= 2;
+
+#ifdef F_SETPIPE_SZ
+        // The writer produces a lot of output - let it write more at once before we have to wake up.
+        // Failing is fine, the pipe is just left with its default size
+        if(!pipe_enlarged && used - old_size >= large_capture) {
+            fcntl(fd, F_SETPIPE_SZ, large_pipe_size);
+            pipe_enlarged = true;
+        }
+#endif
+    }
+    out.resize(used);
+
+    // If the output ends with a newline, trim it
+    if(used > old_size && out.back() == '\n') {
+        out.pop_back();
+    }
 }
 
 template <typename T>
-static void subshell_capture_output(T func, std::string &out) {
+static void forked_capture_output(T func, std::string &out) {
     int pipefd[2];
     if(pipe(pipefd) == -1) {
         perror("pipe");
@@ -988,54 +1501,161 @@ static void subshell_capture_output(T func, std::string &out) {
 
         if(!setup_rewiring({ Redirection::Rewiring, STDOUT_FILENO, pipefd[1] }))
             exit(1);
+        close(pipefd[1]);
 
         func();
 
-        close(pipefd[1]); // TODO: ?
         exit(g.last_return_value);
     }
     close(pipefd[1]);
 
-    bool has_read_something = false;
+    read_capture_pipe(pipefd[0], out);
+
+    close(pipefd[0]);
+
+    job_control::wait_for_one(pid);
+}
 
-    ssize_t nread;
-    char *buf = new char[BUFSIZ];
-    while((nread = read(pipefd[0], buf, BUFSIZ)) > 0) {
-        out.append(buf, static_cast<size_t>(nread));
-        has_read_something = true;
+static bool has_asynchronous_list(const CommandList &cl);
+
+static bool has_asynchronous_list(const Command &cmd) {
+    return std::visit(utils::overloaded {
+        [] (const Command::Empty &) { return false; },
+        [] (const Command::Simple &) { return false; },
+        [] (const Command::BraceGroup &brace_group) { return has_asynchronous_list(brace_group.command_list); },
+        [] (const Command::If &if_command) {
+            for(const Command::If::Elif &elif : if_command.elif) {
+                if(has_asynchronous_list(elif.condition) || has_asynchronous_list(elif.then))
+                    return true;
+            }
+            return has_asynchronous_list(if_command.condition) || has_asynchronous_list(if_command.then)
+                || (if_command.opt_else.has_value() && has_asynchronous_list(*if_command.opt_else));
+        },
+        [] (const Command::While &while_command) {
+            return has_asynchronous_list(while_command.condition) || has_asynchronous_list(while_command.body);
+        },
+        [] (const Command::Until &until_command) {
+            return has_asynchronous_list(until_command.condition) || has_asynchronous_list(until_command.body);
+        },
+        [] (const Command::For &for_command) { return has_asynchronous_list(for_command.body); },
+        // Defining a function doesn't run its body
+        [] (const Command::FunctionDefinition &) { return false; },
+    }, cmd.value);
+}
+
+static bool has_asynchronous_list(const CommandList &cl) {
+    for(const auto &and_or_list : cl) {
+        if(and_or_list.following_operator == "&")
+            return true;
+
+        for(const auto &pipeline : and_or_list.val) {
+            for(const Command &cmd : pipeline.val.commands) {
+                if(has_asynchronous_list(cmd))
+                    return true;
+            }
+        }
     }
-    delete[] buf;
+    return false;
+}
 
-    close(pipefd[0]);
+// Reads the output of an in-process command substitution.
+// Unlike a pipe, the sink never fills up, so builtins can write into it while nobody is reading
+static bool read_capture_sink(int sink, std::string &out) {
+    std::size_t old_size = out.size();
+    if(!utils::read_whole_file(sink, out))
+        return false;
 
     // If the output ends with a newline, trim it
-    if(has_read_something && out.back() == '\n') {
+    if(out.size() > old_size && out.back() == '\n') {
         out.pop_back();
     }
+    return true;
+}
 
-    job_control::wait_for_one(pid);
+// Runs a command substitution without forking a subshell. Everything the body could change in
+// the shell is saved beforehand and restored afterwards, so it behaves as if it ran in a subshell.
+// External commands started by the body write straight into the same sink.
+// Returns false if the substitution couldn't be isolated and has to be run in a forked subshell instead
+static bool in_process_capture_output(const CommandList &parsed, std::string &out) {
+    if(has_asynchronous_list(parsed))
+        return false;
+
+    int sink = utils::create_anonymous_file("kish-command-substitution");
+    if(sink == -1)
+        return false;
+
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(cwd == -1) {
+        close(sink);
+        return false;
+    }
+
+    fflush(stdout);
+    auto saved_stdout = setup_redirections_save_old_fds({ Redirection{ Redirection::Rewiring, STDOUT_FILENO, sink } });
+
+    auto saved_variables = g.variables;
+    auto saved_last_background_pid = g.last_background_pid;
+    auto saved_options = g.options;
+    std::size_t outer_background_jobs = job_control::background_job_count();
+    std::vector<std::pair<std::string, std::shared_ptr<const CommandList>>> functions_log;
+    auto *outer_functions_log = replaced_functions;
+    replaced_functions = &functions_log;
+
+    run_command_list(parsed);
+
+    // Like with a forked subshell, the output is complete only once the jobs started by it finish
+    job_control::wait_for_background_jobs(outer_background_jobs);
+    g.last_background_pid = saved_last_background_pid;
+    g.options = saved_options;
+
+    replaced_functions = outer_functions_log;
+    for(auto it = functions_log.rbegin(); it != functions_log.rend(); ++it) {
+        if(it->second)
+            g.functions[it->first] = std::move(it->second);
+        else
+            g.functions.erase(it->first);
+    }
+    g.variables = std::move(saved_variables);
+
+    fflush(stdout);
+    restore_old_fds(saved_stdout);
+
+    if(fchdir(cwd) == -1)
+        perror("kish: cannot restore the working directory after command substitution");
+    close(cwd);
+
+    if(!read_capture_sink(sink, out)) {
+        perror("kish: command substitution");
+        g.last_return_value = 1;
+    }
+    close(sink);
+
+    return true;
 }
 
 void subshell_capture_output(const std::vector<Token> &tokens, std::string &out)
 {
-    subshell_capture_output([&] {
-        CommandList parsed;
+    std::pmr::monotonic_buffer_resource arena;
+    CommandList parsed(&arena);
 
-        try {
-            parsed = Parser(tokens).parse();
-        } catch(const Parser::SyntaxError &se) {
-            std::cerr << "Syntax error: " << se.explanation << "\n";
-            exit(1);
-        }
+    try {
+        parsed = Parser(tokens, &arena).parse();
+    } catch(const Parser::SyntaxError &se) {
+        std::cerr << "Syntax error: " << se.explanation << "\n";
+        g.last_return_value = 1;
+        return;
+    }
 
-        run_command_list(parsed);
-    }, out);
+    subshell_capture_output(parsed, out);
 }
 
 void subshell_capture_output(const CommandList &parsed, std::string &out)
 {
-    subshell_capture_output([&] {
-        run_command_list(parsed);
+    if(in_process_capture_output(parsed, out))
+        return;
+
+    forked_capture_output([&] {
+        run_command_list(parsed, true);
     }, out);
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <deque>
+#include <optional>
 #include "Token.h"
 #include "Parser.h"
 
@@ -8,6 +10,41 @@ namespace executor {
 
 void subshell_capture_output(const std::vector<Token> &tokens, std::string &out);
 void subshell_capture_output(const CommandList &parsed, std::string &out);
-void run_from_string(const std::string &str);
+// With `exit_after`, the caller promises to exit right after this returns - letting the last command
+// replace the shell process instead of running in a new one
+void run_from_string(const std::string &str, bool exit_after = false);
+// Reads the script a bit at a time, running each command as soon as it's complete.
+// Large scripts that haven't changed since they were last parsed are run from the AST cache instead.
+// Returns false if the file can't be opened
+bool run_from_file(const std::string &path, bool exit_after = false);
+
+// Parses a script without running it and stores it in the AST cache (see ast_cache.h), for `kish --compile`.
+// Syntax errors are reported and set $?. Returns false if the file can't be opened
+bool compile_file(const std::string &path);
+
+// Only parses the commands, to report syntax errors without running anything (`kish -n script`)
+void check_syntax(const std::string &str);
+
+// Runs an expanded simple command as an external program (skipping builtins and functions) and waits for it
+void run_external_command(const Command &expanded_command);
+
+// Replaces a forked process with an expanded simple command: a builtin, a function or an external program
+[[noreturn]] void exec_simple_command(const Command &expanded_command);
+
+// What the bytecode backend (see bytecode.h) runs the commands it doesn't lower itself with -
+// the same code the tree walker uses for them
+
+void run_simple_command_expand_in_main_process(const Command &cmd, bool exit_after);
+void run_empty_command_expand_in_main_process(const Command &cmd);
+void run_function_definition_command_expand_in_main_process(const Command &cmd);
+void run_multi_command_pipeline(const Pipeline &pipeline);
+void run_and_or_list_in_background(const AndOrList &and_or_list);
+
+// Expands and applies the redirections of a compound command, returning the fds to put back with restore_old_fds().
+// If they can't be expanded, reports that and sets $? instead
+std::optional<std::deque<int>> expand_and_setup_redirections(const Command &cmd);
+void restore_old_fds(const std::deque<int> &old_fds);
+
+void expand_for_items(const Command::For &for_command, std::vector<std::string> &expanded_items);
 
 }
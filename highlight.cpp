@@ -1,22 +1,86 @@
 #include "highlight.h"
 
 #include <algorithm>
+#include <chrono>
+#include <memory_resource>
+#include <optional>
 #include <string>
 #include <string_view>
-#include <type_traits>
+#include <vector>
 #include "Parser.h"
 #include "Tokenizer.h"
 #include "WordExpander.h"
 #include "Global.h"
 #include "builtins.h"
+#include "command_hash.h"
 #include "utils.h"
 #include "replxx.hxx"
-#include <sys/stat.h>
 
 namespace highlight {
 
 using replxx::Replxx;
 
+// How long highlighting may take per keystroke. Past that, what's left of the input is colored by its tokens alone -
+// the next keystrokes go on to highlight it in full
+static constexpr std::chrono::milliseconds time_budget { 10 };
+static std::chrono::steady_clock::time_point deadline;
+static bool ran_out_of_time = false;
+
+static bool out_of_time() {
+    if(!ran_out_of_time && std::chrono::steady_clock::now() > deadline)
+        ran_out_of_time = true;
+    return ran_out_of_time;
+}
+
+// A place in the input right after a newline token. Nothing after a newline changes how what's before it is tokenized,
+// so the tokenizer can start over at any of them
+struct Boundary {
+    std::size_t byte = 0;
+    std::size_t codepoint = 0;
+    // Ends a complete command (see Parser::parse_complete_command()), and everything before it was highlighted in full.
+    // Otherwise only tokens were colored up to here
+    bool highlighted_in_full = false;
+};
+
+// What the previous keystrokes highlighted, so that the next one only has to redo what comes after the edit
+struct PreviousInput {
+    std::string input;
+    // In order, the ones highlighted in full first
+    std::vector<Boundary> boundaries;
+    // Colors of the input up to the last of the boundaries
+    Replxx::colors_t colors;
+};
+
+static PreviousInput previous;
+
+// Drops the boundaries after the edit from `previous`
+static void forget_edited(std::string_view input, std::size_t codepoints) {
+    std::size_t unchanged = static_cast<std::size_t>(
+        std::mismatch(input.begin(), input.end(), previous.input.begin(), previous.input.end()).first - input.begin());
+
+    auto stale = std::upper_bound(previous.boundaries.begin(), previous.boundaries.end(), unchanged,
+        [] (std::size_t byte, const Boundary &boundary) { return byte < boundary.byte; });
+    previous.boundaries.erase(stale, previous.boundaries.end());
+
+    if(!previous.boundaries.empty() && previous.boundaries.back().codepoint > codepoints)
+        previous.boundaries.clear();
+
+    previous.input = input;
+    previous.colors.resize(previous.boundaries.empty() ? 0 : previous.boundaries.back().codepoint);
+}
+
+// Tokens of input[from.byte, until), positioned in all of the input
+static std::vector<Token> tokenize_from(std::string_view input, Boundary from, std::size_t until) {
+    std::vector<Token> tokens = Tokenizer(input.substr(from.byte, until - from.byte)).tokenize();
+    for(Token &token : tokens) {
+        token.positionStart += static_cast<int>(from.byte);
+        token.positionEnd += static_cast<int>(from.byte);
+        token.positionStartUtf8Codepoint += static_cast<int>(from.codepoint);
+        token.positionEndUtf8Codepoint += static_cast<int>(from.codepoint);
+    }
+    return tokens;
+}
+
 static void highlight_commandlist(Replxx::colors_t &colors, const CommandList &cl);
 
 static void highlight_word(Replxx::colors_t &colors, const Token *token) {
@@ -25,16 +89,6 @@ static void highlight_word(Replxx::colors_t &colors, const Token *token) {
     }
 }
 
-// check if a potentially signed or unsigned numeric value is less than zero
-// without compiler warnings if the number is indeed signed
-//
-// used for checking if stat.st_mode is not negative
-template <typename T, typename std::enable_if<std::is_unsigned<T>::value, bool>::type = true>
-static bool is_negative(T) { return false; }
-
-template <typename T, typename std::enable_if<std::is_signed<T>::value, bool>::type = true>
-static bool is_negative(T number) { return number < 0; }
-
 static bool command_exists(const std::string &command_name) {
     if(g.functions.contains(command_name))
         return true;
@@ -42,30 +96,7 @@ static bool command_exists(const std::string &command_name) {
     if(find_builtin(command_name).has_value())
         return true;
 
-    if(std::optional<std::string> path = g.get_variable("PATH")) {
-        auto exists = utils::Splitter(path.value()).delim(':').for_each<bool>([&] (const std::string &dir) -> std::optional<bool> {
-            std::string command_path = (dir.empty() ? std::string{"."} : dir) + "/" + command_name;
-            struct stat st;
-            if(stat(command_path.c_str(), &st) != 0) {
-                return {};
-            }
-            if(is_negative(st.st_mode)) {
-                return {};
-            }
-            if(! S_ISREG(st.st_mode)) {
-                return {};
-            }
-            if(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) {
-                return { true };
-            }
-            return {};
-        });
-        if(exists.value_or(false)) {
-            return true;
-        }
-    }
-
-    return false;
+    return command_hash::find(command_name) != nullptr;
 }
 
 static void highlight_command_simple(Replxx::colors_t &colors, const Command &command) {
@@ -75,7 +106,8 @@ static void highlight_command_simple(Replxx::colors_t &colors, const Command &co
         colors[i] = Replxx::Color::DEFAULT;
     }
 
-    if(! simple_command.argv_tokens.empty()) {
+    // Looking the command up is what takes the time - without it, it keeps the default color
+    if(! simple_command.argv_tokens.empty() && ! out_of_time()) {
         const Token *argv0 = simple_command.argv_tokens.at(0);
 
         std::vector<std::string> expandedArgv;
@@ -87,7 +119,7 @@ static void highlight_command_simple(Replxx::colors_t &colors, const Command &co
         opt.unsafeExpansions = false;
         if(! WordExpander(opt, argv0->value).expand_into(expandedArgv) || expandedArgv.empty()) {
             // if word expansion didn't succeed here - just ignore it
-            expandedArgv = { argv0->value };
+            expandedArgv = { std::string(argv0->value) };
         }
 
         Replxx::Color colorOfArgv0;
@@ -153,7 +185,7 @@ static void highlight_command_for(Replxx::colors_t &colors, const Command &comma
 static void highlight_command_functiondefinition(Replxx::colors_t &colors, const Command &command) {
     const Command::FunctionDefinition &function_definition_command = std::get<Command::FunctionDefinition>(command.value);
 
-    highlight_commandlist(colors, function_definition_command.body);
+    highlight_commandlist(colors, *function_definition_command.body);
 }
 
 static void highlight_command(Replxx::colors_t &colors, const Command &command) {
@@ -163,14 +195,14 @@ static void highlight_command(Replxx::colors_t &colors, const Command &command)
     }
 
     std::visit(utils::overloaded {
-          [&] (const Command::Empty) { },
-          [&] (const Command::Simple) { highlight_command_simple(colors, command); },
-          [&] (const Command::BraceGroup) { highlight_command_bracegroup(colors, command); },
-          [&] (const Command::If) { highlight_command_if(colors, command); },
-          [&] (const Command::While) { highlight_command_while(colors, command); },
-          [&] (const Command::Until) { highlight_command_until(colors, command); },
-          [&] (const Command::For) { highlight_command_for(colors, command); },
-          [&] (const Command::FunctionDefinition) { highlight_command_functiondefinition(colors, command); }
+          [&] (const Command::Empty &) { },
+          [&] (const Command::Simple &) { highlight_command_simple(colors, command); },
+          [&] (const Command::BraceGroup &) { highlight_command_bracegroup(colors, command); },
+          [&] (const Command::If &) { highlight_command_if(colors, command); },
+          [&] (const Command::While &) { highlight_command_while(colors, command); },
+          [&] (const Command::Until &) { highlight_command_until(colors, command); },
+          [&] (const Command::For &) { highlight_command_for(colors, command); },
+          [&] (const Command::FunctionDefinition &) { highlight_command_functiondefinition(colors, command); }
     }, command.value);
 
     for(const Redirection &redir : command.redirections) {
@@ -198,11 +230,12 @@ static void highlight_commandlist(Replxx::colors_t &colors, const CommandList &c
     }
 }
 
-static void highlight_everything_by_tokens(std::string const &input, Replxx::colors_t &colors, std::vector<Token> &tokens) {
-    int utf8_index = -1;
-    int byte_index = -1;
+// Colors input[from.byte, until) by `tokens`, the tokens found there
+static void highlight_by_tokens(std::string_view input, Boundary from, std::size_t until, Replxx::colors_t &colors, tcb::span<const Token> tokens) {
+    int utf8_index = static_cast<int>(from.codepoint) - 1;
+    int byte_index = static_cast<int>(from.byte) - 1;
     int token_index = -1;
-    for(char c : input) {
+    for(char c : input.substr(from.byte, until - from.byte)) {
         byte_index += 1;
         // utf-8 multi-byte character - front part
         if(utils::front_of_multibyte_utf8_codepoint(c)) {
@@ -211,7 +244,7 @@ static void highlight_everything_by_tokens(std::string const &input, Replxx::col
         utf8_index += 1;
 
         if(token_index + 1 < static_cast<int>(tokens.size())) {
-            if(byte_index >= tokens.at(token_index + 1).positionStart) {
+            if(byte_index >= tokens[token_index + 1].positionStart) {
                 token_index += 1;
             }
         }
@@ -219,13 +252,13 @@ static void highlight_everything_by_tokens(std::string const &input, Replxx::col
         if(token_index == -1) {
             // empty command line - or a comment followed by nothing or lone whitespace
             colors[utf8_index] = Replxx::Color::GRAY;
-        } else if(tokens.at(token_index).positionEnd < byte_index) {
-            // a comment after some nonwhitespace text
+        } else if(tokens[token_index].positionEnd <= byte_index) {
+            // a comment after some nonwhitespace text (positionEnd is one past the end of the token)
             colors[utf8_index] = Replxx::Color::GRAY;
-        } else if(tokens.at(token_index).type == Token::Type::OPERATOR) {
+        } else if(tokens[token_index].type == Token::Type::OPERATOR) {
             // <, or >>, or |, or ...
             colors[utf8_index] = Replxx::Color::BRIGHTCYAN;
-        } else if(tokens.at(token_index).type == Token::Type::WORD) {
+        } else if(tokens[token_index].type == Token::Type::WORD) {
             // might get everriden by highlight_command_list - but set the default
             //colors[utf8_index] = Replxx::Color::DEFAULT;
             // no longer do this - tokens go last now for easier implementations
@@ -247,22 +280,129 @@ static void highlight_all_red(std::string const &input, Replxx::colors_t &colors
     }
 }
 
+static bool is_newline(const Token &token) {
+    return token.type == Token::Type::OPERATOR && token.value == "\n";
+}
+
 void highlighter_callback(std::string const &input, Replxx::colors_t &colors) {
-    std::vector<Token> tokens;
-    CommandList parsed;
+    deadline = std::chrono::steady_clock::now() + time_budget;
+    ran_out_of_time = false;
+
+    // What's before the edit keeps its colors
+    forget_edited(input, colors.size());
+    std::copy(previous.colors.begin(), previous.colors.end(), colors.begin());
+    std::fill(colors.begin() + static_cast<std::ptrdiff_t>(previous.colors.size()), colors.end(), Replxx::Color::DEFAULT);
+
+    // What's after it is tokenized again, and colored by its tokens to begin with
+    Boundary edited = previous.boundaries.empty() ? Boundary{} : previous.boundaries.back();
+    std::vector<Token> edited_tokens;
     try {
-        tokens = Tokenizer(input).tokenize();
-        parsed = Parser(tokens).parse();
+        edited_tokens = tokenize_from(input, edited, input.size());
     } catch(const Tokenizer::SyntaxError &) {
         highlight_all_red(input, colors);
         return;
+    }
+    highlight_by_tokens(input, edited, input.size(), colors, edited_tokens);
+
+    // Then, from the last command highlighted in full, as many commands as there's time for are parsed and highlighted.
+    // The text before the edit that's only had its tokens colored is tokenized again as it's needed, a piece between boundaries at a time
+    auto first_pending = std::find_if(previous.boundaries.begin(), previous.boundaries.end(),
+        [] (const Boundary &boundary) { return !boundary.highlighted_in_full; });
+    Boundary highlighted = first_pending == previous.boundaries.begin() ? Boundary{} : *std::prev(first_pending);
+    std::vector<Boundary> pending_pieces(first_pending, previous.boundaries.end());
+    previous.boundaries.erase(first_pending, previous.boundaries.end());
+
+    std::vector<Token> tokens;
+    std::size_t parsed_tokens = 0;
+    std::size_t pieces_read = 0;
+    bool read_edited = false;
+    Boundary piece_start = highlighted;
+    // A command that doesn't end in the pieces read so far is parsed again with more of them,
+    // so at least as many tokens as are waiting for it are read - to keep that linear in its length
+    auto read_more_tokens = [&] {
+        std::size_t wanted = tokens.size() - parsed_tokens + 1;
+        std::size_t old_size = tokens.size();
+        while(tokens.size() - old_size < wanted && !read_edited) {
+            if(pieces_read < pending_pieces.size()) {
+                Boundary piece_end = pending_pieces[pieces_read++];
+                std::vector<Token> piece_tokens = tokenize_from(input, piece_start, piece_end.byte);
+                tokens.insert(tokens.end(), piece_tokens.begin(), piece_tokens.end());
+                piece_start = piece_end;
+            } else {
+                tokens.insert(tokens.end(), edited_tokens.begin(), edited_tokens.end());
+                read_edited = true;
+            }
+        }
+    };
+
+    bool syntax_error = false;
+    try {
+        while(! out_of_time()) {
+            tcb::span<const Token> unparsed = tcb::span<const Token>(tokens).subspan(parsed_tokens);
+            std::pmr::monotonic_buffer_resource arena;
+            Parser parser(unparsed, &arena);
+            std::optional<CommandList> parsed;
+            try {
+                parsed = parser.parse_complete_command();
+            } catch(const Parser::SyntaxError &se) {
+                if(! se.end_of_input || read_edited)
+                    throw;
+            }
+
+            if(! parsed.has_value()) {
+                if(! read_edited) {
+                    read_more_tokens();
+                    continue;
+                }
+                // the last command, without a newline after it
+                highlight_commandlist(colors, Parser(unparsed, &arena).parse());
+                highlight_by_tokens(input, highlighted, input.size(), colors, unparsed);
+                break;
+            }
+
+            tcb::span<const Token> command_tokens = unparsed.first(parser.consumed_tokens());
+            Boundary command_end {
+                static_cast<std::size_t>(command_tokens.back().positionEnd),
+                static_cast<std::size_t>(command_tokens.back().positionEndUtf8Codepoint),
+                true
+            };
+            highlight_commandlist(colors, parsed.value());
+            highlight_by_tokens(input, highlighted, command_end.byte, colors, command_tokens);
+            if(ran_out_of_time) {
+                // with some of its commands not looked up
+                break;
+            }
+
+            previous.boundaries.push_back(command_end);
+            highlighted = command_end;
+            parsed_tokens += command_tokens.size();
+        }
+    } catch(const Tokenizer::SyntaxError &) {
+        syntax_error = true;
     } catch(const Parser::SyntaxError &) {
+        syntax_error = true;
+    }
+
+    for(const Boundary &boundary : pending_pieces) {
+        if(boundary.byte > highlighted.byte)
+            previous.boundaries.push_back(boundary);
+    }
+    for(const Token &token : edited_tokens) {
+        if(is_newline(token) && static_cast<std::size_t>(token.positionEnd) > highlighted.byte)
+            previous.boundaries.push_back({ static_cast<std::size_t>(token.positionEnd), static_cast<std::size_t>(token.positionEndUtf8Codepoint) });
+    }
+    if(! previous.boundaries.empty()) {
+        auto colored_until = static_cast<std::ptrdiff_t>(previous.boundaries.back().codepoint);
+        previous.colors.assign(colors.begin(), colors.begin() + colored_until);
+    }
+
+    if(syntax_error) {
         highlight_all_red(input, colors);
-        return;
     }
+}
 
-    highlight_commandlist(colors, parsed);
-    highlight_everything_by_tokens(input, colors, tokens);
+void forget_previous_input() {
+    previous = {};
 }
 
 } // namespace highlight
@@ -5,6 +5,11 @@
 
 namespace highlight {
 
+// Called on every keystroke. Keeps what it highlighted, to only redo the part of the input after the edit
 void highlighter_callback(std::string const &input, replxx::Replxx::colors_t &colors);
 
+// To be called before a new line is read: the commands run in between can change how the same text is highlighted
+// (by defining functions, or changing $PATH)
+void forget_previous_input();
+
 }
@@ -7,6 +7,18 @@
 #include <sys/types.h>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <unordered_map>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/syscall.h>
+#ifdef SYS_pidfd_open
+#define KISH_HAVE_PIDFD
+#endif
+#endif
 #include "Global.h"
 
 namespace job_control {
@@ -16,6 +28,20 @@ static struct termios shell_tmodes;
 static int shell_terminal;
 static bool shell_is_interactive = false;
 
+/* In a process forked by an interactive shell, which is a part of a job */
+static bool in_interactive_job = false;
+
+struct BackgroundJob {
+    pid_t pid;
+    std::optional<int> return_value; // set once the job has been reaped
+};
+
+// In the order they were started
+static std::vector<BackgroundJob> background_jobs;
+
+// Finished jobs nobody waited for are forgotten after that many more get started
+static constexpr std::size_t max_remembered_background_jobs = 1024;
+
 // This file is based on
 // https://www.gnu.org/software/libc/manual/html_node/Implementing-a-Shell.html
 
@@ -52,42 +78,35 @@ void init_interactive_shell() {
 }
 
 void noninteractive_wait_for_one(pid_t pid) {
-    int status;
+    g.last_return_value = wait_for_any({ pid }).return_value;
+}
 
-    do {
-        if(waitpid(pid, &status, WUNTRACED | WCONTINUED) == -1) {
-            // TODO: do we get here only when interrupted?
-            perror("waitpid");
-            exit(1);
-        }
-    } while(!WIFEXITED(status) && !WIFSIGNALED(status));
+void wait_for_one(pid_t pid) {
+    /* The job got the terminal when it was started */
+    noninteractive_wait_for_one(pid);
 
-    if(WIFEXITED(status))
-        g.last_return_value = WEXITSTATUS(status);
+    /* Put the shell back in the foreground and restore its terminal modes.  */
+    take_back_terminal();
 }
 
-void wait_for_one(pid_t pid) {
-    if(shell_is_interactive) {
-        /* Put the job into the foreground.  */
-        tcsetpgrp(job_control::shell_terminal, pid);
-    }
+void wait_for_all(const std::vector<pid_t> &pids, std::vector<int> &return_values) {
+    return_values.assign(pids.size(), 0);
+    if (pids.empty())
+        return;
 
-    noninteractive_wait_for_one(pid);
+    /* Collect the children in the order they finish, so that a stage that exits early
+     * doesn't stay a zombie until every stage before it is done */
+    std::vector<pid_t> remaining = pids;
+    while (!remaining.empty()) {
+        FinishedChild child = wait_for_any(remaining);
 
-    if(shell_is_interactive) {
-        /* Put the shell back in the foreground.  */
-        tcsetpgrp(job_control::shell_terminal, job_control::shell_pgid);
+        std::size_t index = static_cast<std::size_t>(std::find(pids.begin(), pids.end(), child.pid) - pids.begin());
+        return_values.at(index) = child.return_value;
 
-        /* Restore the shell’s terminal modes.  */
-        //tcgetattr(job_control::shell_terminal, job_control::shell_tmodes);
-        tcsetattr(job_control::shell_terminal, TCSADRAIN, &job_control::shell_tmodes);
+        remaining.erase(std::find(remaining.begin(), remaining.end(), child.pid));
     }
-}
 
-void wait_for_all(const std::vector<int> &pids) {
-    for(pid_t pid : pids) {
-        wait_for_one(pid);
-    }
+    take_back_terminal();
 }
 
 void before_exec_no_pipeline(bool foreground) {
@@ -109,14 +128,304 @@ void before_exec_no_pipeline(bool foreground) {
 }
 
 pid_t fork_own_process_group() {
+    return fork_into_process_group(0, true);
+}
+
+pid_t fork_into_process_group(pid_t pgid, bool foreground) {
     pid_t pid = fork();
-    if(shell_is_interactive && pid >= 0) {
-        // Put the process into the process group
-        // This has to be done both by the shell and in the individual
-        // child processes because of potential race conditions.
+    if(!shell_is_interactive || pid == -1)
+        return pid;
+
+    // Put the process into the process group
+    // This has to be done both by the shell and in the individual
+    // child processes because of potential race conditions.
+    // If every process of the group has exited already, start a new one.
+    // (EACCES only means that the child has already done it itself and called exec())
+    if(setpgid(pid, pgid) == -1 && errno == EPERM && pgid != 0) {
         setpgid(pid, 0);
+        pgid = 0;
+    }
+
+    // The terminal is handed over once per job, when its first process starts.
+    // Again, by both the shell and the child, so that it happens before the child can read from it
+    if(foreground && pgid == 0)
+        tcsetpgrp(shell_terminal, pid == 0 ? getpid() : pid);
+
+    if(pid == 0) {
+        /* Set the handling for job control signals back to the default.  */
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+
+        // Everything this process starts belongs to the same job - only the shell moves
+        // processes between process groups and the terminal between jobs
+        shell_is_interactive = false;
+        in_interactive_job = true;
     }
+
     return pid;
 }
 
+void take_back_terminal() {
+    if(shell_is_interactive) {
+        tcsetpgrp(shell_terminal, shell_pgid);
+        tcsetattr(shell_terminal, TCSADRAIN, &shell_tmodes);
+    }
+}
+
+bool spawn_own_process_group(posix_spawnattr_t *attr, posix_spawn_file_actions_t *actions) {
+    if (!shell_is_interactive)
+        return true;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    /* Same as setpgid(0, 0) in a forked child */
+    if (posix_spawnattr_setpgroup(attr, 0) != 0)
+        return false;
+
+    /* Set the handling for job control signals back to the default.  */
+    sigset_t default_signals;
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGINT);
+    sigaddset(&default_signals, SIGQUIT);
+    sigaddset(&default_signals, SIGTSTP);
+    sigaddset(&default_signals, SIGTTIN);
+    sigaddset(&default_signals, SIGTTOU);
+    if (posix_spawnattr_setsigdefault(attr, &default_signals) != 0)
+        return false;
+
+    if (posix_spawnattr_setflags(attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF) != 0)
+        return false;
+
+    /* give the process group the terminal - the child has all signals blocked at this point,
+     * so it won't get stopped by SIGTTOU */
+    if (posix_spawn_file_actions_addtcsetpgrp_np(actions, shell_terminal) != 0)
+        return false;
+
+    return true;
+#else
+    /* Without a way to hand the terminal over to the new process group before
+     * exec(), an interactive shell has to fork */
+    (void) attr;
+    (void) actions;
+    return false;
+#endif
+}
+
+static int status_to_return_value(int status) {
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+#ifdef KISH_HAVE_PIDFD
+/* pidfds of the children currently being waited for, opened once per child */
+static std::unordered_map<pid_t, int> child_pidfds;
+
+static int pidfd_for(pid_t pid) {
+    auto found = child_pidfds.find(pid);
+    if (found != child_pidfds.end())
+        return found->second;
+
+    /* pidfds are always close-on-exec */
+    int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd != -1)
+        child_pidfds.emplace(pid, pidfd);
+    return pidfd;
+}
+
+static void forget_pidfd(pid_t pid) {
+    auto found = child_pidfds.find(pid);
+    if (found != child_pidfds.end()) {
+        close(found->second);
+        child_pidfds.erase(found);
+    }
+}
+#endif
+
+/* The only place children get reaped. Returns false if the child hasn't finished yet */
+static bool reap(pid_t pid, int options, FinishedChild &finished) {
+    int status;
+    struct rusage usage;
+    pid_t result;
+    do {
+        result = wait4(pid, &status, options, &usage);
+    } while (result == -1 && errno == EINTR);
+
+    if (result == 0)
+        return false;
+
+    if (result == -1) {
+        /* Not a child of this shell (anymore) */
+        finished = FinishedChild{pid, 127, {}};
+    } else {
+        if (!WIFEXITED(status) && !WIFSIGNALED(status))
+            return false;
+        finished = FinishedChild{pid, status_to_return_value(status), usage};
+    }
+
+#ifdef KISH_HAVE_PIDFD
+    forget_pidfd(pid);
+#endif
+    return true;
+}
+
+#ifdef KISH_HAVE_PIDFD
+/* Sleeps in poll(2) on the children's pidfds - they become readable when the child exits.
+ * Returns false if pidfds aren't available, for example on kernels older than 5.3 */
+static bool wait_for_any_pidfd(const std::vector<pid_t> &pids, FinishedChild &finished) {
+    std::vector<struct pollfd> pollfds;
+    pollfds.reserve(pids.size());
+    for (pid_t pid : pids) {
+        int pidfd = pidfd_for(pid);
+        if (pidfd == -1)
+            return false;
+        pollfds.push_back(pollfd{pidfd, POLLIN, 0});
+    }
+
+    for (;;) {
+        if (poll(pollfds.data(), pollfds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        for (std::size_t i = 0; i < pollfds.size(); i++) {
+            if (pollfds[i].revents != 0 && reap(pids[i], WNOHANG, finished))
+                return true;
+        }
+    }
+}
+#endif
+
+static void ignore_signal(int) {}
+
+/* Polls every pid with WNOHANG and sleeps until the next SIGCHLD in between.
+ * SIGCHLD is blocked while polling, so none can get lost */
+static void wait_for_any_sigchld(const std::vector<pid_t> &pids, FinishedChild &finished) {
+    sigset_t sigchld, old_mask;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+
+    struct sigaction action = {}, old_action;
+    action.sa_handler = ignore_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, &old_action);
+
+    sigset_t wait_mask = old_mask;
+    sigdelset(&wait_mask, SIGCHLD);
+
+    bool found = false;
+    while (!found) {
+        for (pid_t pid : pids) {
+            if (reap(pid, WNOHANG, finished)) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            sigsuspend(&wait_mask);
+    }
+
+    sigaction(SIGCHLD, &old_action, nullptr);
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+}
+
+FinishedChild wait_for_any(const std::vector<pid_t> &pids) {
+    FinishedChild finished = {};
+
+    /* waitpid(-1) can't be used - it would also reap background jobs */
+    if (pids.size() == 1) {
+        while (!reap(pids.front(), 0, finished)) {}
+        return finished;
+    }
+
+#ifdef KISH_HAVE_PIDFD
+    if (wait_for_any_pidfd(pids, finished))
+        return finished;
+#endif
+
+    wait_for_any_sigchld(pids, finished);
+    return finished;
+}
+
+void become_background_job() {
+    if (!in_interactive_job) {
+        /* POSIX 2.11: without job control, asynchronous lists ignore SIGINT and SIGQUIT
+         * and get /dev/null as stdin before any explicit redirections */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+
+        int dev_null = open("/dev/null", O_RDONLY);
+        if (dev_null != -1 && dev_null != STDIN_FILENO) {
+            dup2(dev_null, STDIN_FILENO);
+            close(dev_null);
+        }
+    }
+
+    /* The parent's jobs aren't ours to wait for */
+    background_jobs.clear();
+}
+
+void add_background_job(pid_t pid) {
+    reap_background_jobs();
+
+    if (background_jobs.size() >= max_remembered_background_jobs) {
+        background_jobs.erase(std::remove_if(background_jobs.begin(), background_jobs.end(), [](const BackgroundJob &job) {
+            return job.return_value.has_value();
+        }), background_jobs.end());
+    }
+
+    background_jobs.push_back(BackgroundJob{pid, std::nullopt});
+}
+
+void reap_background_jobs() {
+    for (BackgroundJob &job : background_jobs) {
+        FinishedChild finished;
+        if (!job.return_value.has_value() && reap(job.pid, WNOHANG, finished))
+            job.return_value = finished.return_value;
+    }
+}
+
+std::size_t background_job_count() {
+    return background_jobs.size();
+}
+
+static int wait_until_finished(const BackgroundJob &job) {
+    if (job.return_value.has_value())
+        return job.return_value.value();
+
+    return wait_for_any({ job.pid }).return_value;
+}
+
+std::optional<int> wait_for_background_job(pid_t pid) {
+    auto job = std::find_if(background_jobs.begin(), background_jobs.end(), [&](const BackgroundJob &job) {
+        return job.pid == pid;
+    });
+    if (job == background_jobs.end())
+        return std::nullopt;
+
+    int return_value = wait_until_finished(*job);
+    background_jobs.erase(job);
+    return return_value;
+}
+
+void wait_for_background_jobs(std::size_t first) {
+    std::vector<pid_t> running;
+    for (std::size_t i = first; i < background_jobs.size(); i++) {
+        if (!background_jobs[i].return_value.has_value())
+            running.push_back(background_jobs[i].pid);
+    }
+
+    while (!running.empty()) {
+        FinishedChild child = wait_for_any(running);
+        running.erase(std::find(running.begin(), running.end(), child.pid));
+    }
+
+    background_jobs.erase(background_jobs.begin() + static_cast<std::ptrdiff_t>(std::min(first, background_jobs.size())), background_jobs.end());
+}
+
 } // namespace job_control
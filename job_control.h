@@ -1,9 +1,13 @@
 #pragma once
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <spawn.h>
 #include <termios.h>
 #include <unistd.h>
 #include <vector>
+#include <optional>
+#include <cstddef>
 
 namespace job_control {
 
@@ -11,9 +15,39 @@ namespace job_control {
 /* so the API of this file is kind of C-like */
 void noninteractive_wait_for_one(pid_t pid);
 void wait_for_one(pid_t pid);
-void wait_for_all(const std::vector<int> &pids);
+/* Stores the $? of each of `pids` into `return_values`, in the same order */
+void wait_for_all(const std::vector<pid_t> &pids, std::vector<int> &return_values);
 void init_interactive_shell();
 void before_exec_no_pipeline(bool foreground);
+/* fork(), starting a new foreground job */
 pid_t fork_own_process_group();
+/* fork(), with the child joining the job with process group `pgid` - or starting a new job if it's 0.
+ * A new foreground job gets the terminal right away */
+pid_t fork_into_process_group(pid_t pgid, bool foreground);
+void take_back_terminal();
+
+struct FinishedChild {
+    pid_t pid;
+    int return_value; /* $? - 128+N when killed by signal N */
+    struct rusage rusage;
+};
+
+/* The waiting primitive for everything the shell starts: blocks until any of `pids` finishes and
+ * reaps only that one, leaving other children alone. Children are returned in the order they finish */
+FinishedChild wait_for_any(const std::vector<pid_t> &pids);
+
+/* posix_spawn(3) equivalent of fork_own_process_group() + before_exec_no_pipeline(true).
+ * Returns false if job control can't be set up without forking */
+bool spawn_own_process_group(posix_spawnattr_t *attr, posix_spawn_file_actions_t *actions);
+
+/* Asynchronous lists (`cmd &`) */
+void become_background_job();
+void add_background_job(pid_t pid);
+void reap_background_jobs();
+std::size_t background_job_count();
+/* Returns the job's $?, or nullopt if pid isn't a background job of this shell */
+std::optional<int> wait_for_background_job(pid_t pid);
+/* Waits for the background jobs started after the first `first` ones */
+void wait_for_background_jobs(std::size_t first = 0);
 
 }
@@ -3,10 +3,13 @@
 #include <unistd.h>
 #include <fstream>
 #include <cstring>
+#include <algorithm>
+#include <errno.h>
 #include "Global.h"
 #include "executor.h"
 #include "repl.h"
 #include "job_control.h"
+#include "builtins/set.h"
 
 
 static void initialize_variables() {
@@ -23,22 +26,30 @@ static void load_kishrc() {
         return;
     }
 
+    executor::run_from_file(home + "/.kishrc");
+}
+
+// Only for checking the syntax - scripts are run while they're read, see executor::run_from_file()
+static std::string read_script(const char *path) {
     // TODO: make this efficiant
     // TODO: don't save the whole file at all
     std::string lines;
-    std::ifstream f(home + "/.kishrc");
+    std::ifstream f(path);
     std::string line;
     while(std::getline(f, line)) {
         lines.append(line);
         lines.append("\n");
     }
-    executor::run_from_string(lines);
+    return lines;
 }
 
 static void usage(const char *ownName) {
     std::cerr << "Usage: " << ownName << "\n"
               << "   or: " << ownName << " -c <command>\n"
-              << "   or: " << ownName << " <scriptfile>\n";
+              << "   or: " << ownName << " <scriptfile>\n"
+              << "   or: " << ownName << " -n <scriptfile>   (only check the syntax)\n"
+              << "   or: " << ownName << " --compile <scriptfile>...   (parse scripts into the cache ahead of time)\n"
+              << "Any of these can be preceded by options to set, like `-o pipefail`\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -47,25 +58,45 @@ int main(int argc, char *argv[]) {
 
     initialize_variables();
 
+    const char *ownName = argc > 0 ? argv[0] : "kish";
+
+    // `kish -o pipefail -c ...` - the same as starting with `set -o pipefail`
+    while(argc >= 3 && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0)) {
+        Command::Simple set;
+        set.argv = {"set", argv[1], argv[2]};
+        if(builtin_set(set) != 0) {
+            usage(ownName);
+            return 2;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     job_control::init_interactive_shell();
     if(argc == 1) {
         load_kishrc();
         repl::run();
     } else if(argc == 2 && argv[1][0] != '-') {
-        // TODO: make this efficiant
-        // TODO: don't save the whole file at all
-        std::string lines;
-        std::ifstream f(argv[1]);
-        std::string line;
-        while(std::getline(f, line)) {
-            lines.append(line);
-            lines.append("\n");
+        if(!executor::run_from_file(argv[1], true)) {
+            std::cerr << ownName << ": " << argv[1] << ": " << strerror(errno) << "\n";
+            return 127;
+        }
+    } else if(argc == 3 && strcmp(argv[1], "-n") == 0) {
+        executor::check_syntax(read_script(argv[2]));
+    } else if(argc >= 3 && strcmp(argv[1], "--compile") == 0) {
+        int status = 0;
+        for(int i = 2; i < argc; i++) {
+            if(!executor::compile_file(argv[i])) {
+                std::cerr << ownName << ": " << argv[i] << ": " << strerror(errno) << "\n";
+                g.last_return_value = 1;
+            }
+            status = std::max(status, g.last_return_value);
         }
-        executor::run_from_string(lines);
+        return status;
     } else if(argc == 3 && strcmp(argv[1], "-c") == 0) {
-        executor::run_from_string(argv[2]);
+        executor::run_from_string(argv[2], true);
     } else {
-        usage(argc > 0 ? argv[0] : "kish");
+        usage(ownName);
         return 1;
     }
 
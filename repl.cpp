@@ -10,6 +10,7 @@
 #include "utils.h"
 #include "replxx.hxx"
 #include "completion.h"
+#include "job_control.h"
 
 using replxx::Replxx;
 
@@ -25,7 +26,7 @@ static std::string prompt() {
 
         // Don't let prompt_PS1 modify $?
         int last_return_value = g.last_return_value;
-        executor::subshell_capture_output(prompt_fun->second, output);
+        executor::subshell_capture_output(*prompt_fun->second, output);
         g.last_return_value = last_return_value;
 
         return output;
@@ -50,6 +51,9 @@ static std::optional<std::string> get_history_path() {
 static std::string read_line(Replxx &replxx) {
     char const * cinput { nullptr }; // should not be freed
 
+    job_control::reap_background_jobs();
+    highlight::forget_previous_input();
+
     do {
         cinput = replxx.input(prompt());
     } while(cinput == nullptr && errno == EAGAIN);
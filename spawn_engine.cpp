@@ -0,0 +1,186 @@
+#include "spawn_engine.h"
+
+#include <spawn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include "command_hash.h"
+#include "job_control.h"
+
+extern char **environ;
+
+namespace spawn_engine {
+
+void build_argv(const std::vector<std::string> &argv, std::vector<char *> &out) {
+    out.clear();
+    for(const std::string &arg : argv) {
+        // exec*() and posix_spawn() take `char *const argv[]` but promise not to modify the strings
+        out.push_back(const_cast<char *>(arg.c_str()));
+    }
+    out.push_back(nullptr);
+}
+
+[[noreturn]] void exec_external_command(const std::vector<std::string> &argv) {
+    const std::string &name = argv.at(0);
+
+    std::vector<char *> c_argv;
+    build_argv(argv, c_argv);
+
+    bool search_path = name.find('/') == std::string::npos;
+
+    // Two attempts: if the path remembered for the command is stale, look it up again
+    for(int attempt = 0; attempt < 2; attempt++) {
+        std::string path = name;
+        if(search_path) {
+            const command_hash::Entry *entry = command_hash::find_for_exec(name);
+            if(entry == nullptr) {
+                errno = ENOENT;
+                break;
+            }
+            path = entry->path;
+        }
+
+        execv(path.c_str(), c_argv.data());
+
+        if(errno == ENOEXEC) {
+            // Not a binary and without a #! line - like execvp(3), run it with the system shell
+            std::vector<char *> sh_argv { const_cast<char *>("sh"), path.data() };
+            sh_argv.insert(sh_argv.end(), c_argv.begin() + 1, c_argv.end());
+            execv("/bin/sh", sh_argv.data());
+            errno = ENOEXEC;
+            break;
+        }
+
+        if(errno != ENOENT || !search_path)
+            break;
+
+        command_hash::forget(name);
+    }
+
+    perror(name.c_str());
+    exit(127);
+}
+
+static bool is_overridden_by(const char *env_entry, const Command::Simple::VariableAssignments &assignments) {
+    const char *equals = strchr(env_entry, '=');
+    size_t name_len = equals ? static_cast<size_t>(equals - env_entry) : strlen(env_entry);
+
+    for(const Command::Simple::VariableAssignment &va : assignments) {
+        if(va.name.size() == name_len && strncmp(va.name.c_str(), env_entry, name_len) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Environment for `a=b cmd`: environ with the inline variables added or replaced
+static char **build_envp(const Command::Simple::VariableAssignments &assignments) {
+    if(assignments.empty())
+        return environ;
+
+    // Kept between calls so that a loop running `a=b cmd` doesn't allocate after the first iteration
+    static std::vector<std::string> assignment_strings;
+    static std::vector<char *> envp;
+
+    assignment_strings.resize(assignments.size());
+    for(size_t i = 0; i < assignments.size(); i++) {
+        assignment_strings[i].assign(assignments[i].name);
+        assignment_strings[i].push_back('=');
+        assignment_strings[i].append(assignments[i].value);
+    }
+
+    envp.clear();
+    for(char **env = environ; *env != nullptr; env++) {
+        if(!is_overridden_by(*env, assignments))
+            envp.push_back(*env);
+    }
+    for(std::string &assignment : assignment_strings) {
+        envp.push_back(assignment.data());
+    }
+    envp.push_back(nullptr);
+
+    return envp.data();
+}
+
+static int file_redirection_open_flags(const Redirection &redir) {
+    if(redir.type == Redirection::FileRead)
+        return O_RDONLY;
+    if(redir.type == Redirection::FileWrite)
+        return O_WRONLY | O_CREAT | O_TRUNC;
+    return O_WRONLY | O_CREAT | O_APPEND;
+}
+
+static bool add_redirections(posix_spawn_file_actions_t *actions, const Redirections &redirections) {
+    for(const Redirection &redir : redirections) {
+        if(redir.type == Redirection::Rewiring) {
+            if(redir.fd == redir.rewire_fd)
+                continue;
+
+            if(posix_spawn_file_actions_adddup2(actions, redir.rewire_fd, redir.fd) != 0)
+                return false;
+        } else {
+            if(posix_spawn_file_actions_addopen(actions, redir.fd, redir.path.c_str(), file_redirection_open_flags(redir), 0666) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+std::optional<pid_t> spawn_expanded_simple_command(const Command &expanded_command) {
+#ifdef KISH_NO_SPAWN
+    (void) expanded_command;
+    return {};
+#else
+    const Command::Simple &expanded_simple = std::get<Command::Simple>(expanded_command.value);
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    if(posix_spawnattr_init(&attr) != 0)
+        return {};
+    if(posix_spawn_file_actions_init(&actions) != 0) {
+        posix_spawnattr_destroy(&attr);
+        return {};
+    }
+
+    std::optional<pid_t> result;
+
+    // Job control has to be set up before the redirections - those can replace the terminal fd
+    if(job_control::spawn_own_process_group(&attr, &actions) && add_redirections(&actions, expanded_command.redirections)) {
+        static std::vector<char *> argv;
+        build_argv(expanded_simple.argv, argv);
+        char **envp = build_envp(expanded_simple.variable_assignments);
+
+        const std::string &name = expanded_simple.argv.at(0);
+        bool search_path = name.find('/') == std::string::npos;
+
+        // Two attempts: if the path remembered for the command is stale, look it up again
+        for(int attempt = 0; attempt < 2 && !result.has_value(); attempt++) {
+            const char *path = name.c_str();
+            if(search_path) {
+                // Commands that can't be found are left for the fork() + exec() path to report
+                const command_hash::Entry *entry = command_hash::find_for_exec(name);
+                if(entry == nullptr)
+                    break;
+                path = entry->path.c_str();
+            }
+
+            pid_t pid;
+            int error = posix_spawn(&pid, path, &actions, &attr, argv.data(), envp);
+            if(error == 0)
+                result = pid;
+            else if(error == ENOENT && search_path)
+                command_hash::forget(name);
+            else
+                break;
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    return result;
+#endif
+}
+
+} // namespace spawn_engine
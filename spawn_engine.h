@@ -0,0 +1,25 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "Parser.h"
+
+namespace spawn_engine {
+
+// Starts an already expanded simple command as an external program, without looking for builtins
+// or functions, using posix_spawn(3) instead of fork() + exec().
+// Returns the pid of the child, or nullopt if the command could not be spawned that way - the
+// caller should then fall back to fork() + exec(), which also takes care of reporting errors.
+std::optional<pid_t> spawn_expanded_simple_command(const Command &expanded_command);
+
+// Replaces the current process with an external program, like execvp(3) but finding it through
+// the command hash table. Prints an error and exits with 127 if that's not possible
+[[noreturn]] void exec_external_command(const std::vector<std::string> &argv);
+
+// Fills `out` with pointers into `argv` suitable for exec*(), terminated with a nullptr.
+// `out` is expected to be reused between calls so that it doesn't have to allocate
+void build_argv(const std::vector<std::string> &argv, std::vector<char *> &out);
+
+}
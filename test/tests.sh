@@ -273,5 +273,237 @@ ktest 'echo $(f(){ echo in command subst; }; f)' 'in command subst'
 ktest 'echo $(f(){ echo in command subst; }; f > /dev/null | f)' 'in command subst'
 ktest 'f() { echo 1; }; f () { echo 2; } | f(){ echo 3; }; f' 1
 ktest 'f() { echo [$#]; }; f 1 2; echo $(f 1 2 3)' $'[2]\n[3]'
+ktest 'command -v cd' 'cd'
+ktest 'command -v sh' "$(command -v sh)"
+ktest 'command -v no-such-command-kish' '' '' 1
+ktest 'f() { echo function; }; command -v f' 'f'
+ktest 'type if cd' $'if is a shell keyword\ncd is a shell builtin'
+ktest 'type no-such-command-kish' '' 'type: no-such-command-kish: not found' 1
+ktest 'hash sh; type sh' "sh is hashed ($(command -v sh))"
+ktest 'hash -r; hash' '' 'hash: hash table empty'
+ktest 'cat() { echo function; }; command cat < /dev/null; cat' 'function'
+ktest 'PATH=/nonexistent; sh -c true' '' 'sh: No such file or directory' 127
+ktest 'echo -n a; echo b' 'ab'
+ktest 'echo -e "a\\tb\\0101"' $'a\tbA'
+ktest 'echo -e "a\\cb"; echo c' 'ac'
+ktest 'echo -x -- a' '-x -- a'
+ktest 'printf "%s-%s\\n" 1 2 3' $'1-2\n3-'
+ktest 'printf "%5.2f|%-3d|%x|%o|%c\\n" 3.14159 7 255 8 xyz' ' 3.14|7  |ff|10|x'
+ktest 'printf "%*d|%%|%i\\n" 4 2 "'"'"'a"' '   2|%|97'
+ktest 'printf "%b|%s\\n" "a\\nb" "a\\nb"' $'a\nb|a\\nb'
+ktest 'printf "%q\\n" "a b" "" "$(printf "x\\ty")"' $'a\\ b\n\'\'\n$\'x\\ty\''
+ktest 'printf %d abc' '0' "printf: 'abc': invalid number" 1
+ktest 'printf -v var "%s=%d" x 5; echo "[$var]"' '[x=5]'
+ktest 'printf -v 1x a' '' "printf: '1x': not a valid variable name" 1
+ktest '[ 1 -lt 2 ] && test abc = abc && [ ! -z x ] && echo ok' 'ok'
+ktest '[ "!" = "!" ] && [ -n ] && [ ! ] && echo ok' 'ok'
+ktest 'test 1 -eq 2 -o ! -d /nonexistent -a -f /nonexistent || echo ok' 'ok'
+ktest '[ \( -d / -o -f / \) -a -e / ] && echo ok' 'ok'
+ktest '[ / -ef / ] && [ ! / -nt / ] && [ / -nt /nonexistent ] && echo ok' 'ok'
+ktest '[ a -eq 1 ]' '' '[: a: integer expression expected' 2
+ktest '[ 1 = 1' '' "[: missing ']'" 2
+ktest 'test' '' '' 1
+ktest 'printenv KISH_FORKS_AVOIDED' '1'
+ktest 'true && printenv KISH_FORKS_AVOIDED' '1'
+ktest 'echo $(printenv KISH_FORKS_AVOIDED)' ''
+ktest '{ true; printenv KISH_FORKS_AVOIDED; } | cat' '1'
+ktest 'printenv KISH_FORKS_AVOIDED; true' '' '' 0
+ktest '! printenv KISH_FORKS_AVOIDED' '' '' 0
+ktest 'sh -c "exit 3"' '' '' 3
+
+# command substitutions run in the shell process must not leak state
+ktest 'a=1; b=$(a=2; echo $a); echo $a $b' '1 2'
+ktest 'x=$(cd /; pwd); [ "$(pwd)" != / ] && echo $x' '/'
+ktest 'f() { echo outer; }; echo $(f() { echo inner; }; f) $(f)' 'inner outer'
+ktest 'x=$(g() { echo g; }; g); type g >/dev/null 2>/dev/null || echo $x gone' 'g gone'
+ktest 'x=$(false); echo $?' '1'
+ktest 'echo $(echo a; printenv HOME >/dev/null; echo b)' 'a b'
+ktest 'x=$(echo $(echo $(echo nested))); echo $x' 'nested'
+ktest 'x=$(printf "%070000d" 0); printf %s "$x" | wc -c' '70000'
+ktest 'f() { printf %s "[$1]"; }; x=$(f a)$(f b); echo $x' '[a][b]'
+ktest 'x=$(echo out; echo hidden >/dev/null); echo $x; echo after' 'out
+after'
+
+# captured output is split into fields in bulk
+ktest 'echo $(printf "%s   " one two three)' 'one two three'
+ktest 'echo $(seq 20000) | wc -w' '20000'
+ktest 'echo $(echo /bi?)' '/bin'
+ktest 'x="a  nonexistent*"; echo $x' 'a nonexistent*'
+
+# pipeline stages only keep their own pipe ends open
+ktest 'ls /proc/self/fd | cat | tr "\\n" " "' '0 1 2 3 '
+ktest '{ echo a | cat; echo b; } | cat | cat' 'a
+b'
+ktest 'echo x | { read v; echo $v$v; } | cat' 'xx'
+ktest 'for i in 1 2 3; do echo $i | cat | cat; done' '1
+2
+3'
+
+# asynchronous lists
+ktest 'sleep 0.2 && echo second & echo first; wait' 'first
+second'
+ktest 'false & wait $!; echo $?' '1'
+ktest 'sh -c "exit 3" & pid=$!; true; wait $pid; echo $?' '3'
+ktest 'true & a=$!; false & b=$!; wait $a $b; echo $?' '1'
+ktest 'sh -c "kill -9 \$\$" & wait $!; echo $?' '137'
+ktest 'wait 1; echo $?' '127' 'wait: pid 1 is not a child of this shell'
+ktest 'wait x; echo $?' '2' "wait: 'x': not a pid"
+ktest 'false; true & echo $?' '0'
+ktest 'echo $!' ''
+ktest 'x=5 & echo $x' ''
+ktest 'read line & wait; echo "[$line]"' '[]'
+ktest 'x=$(sleep 0.1 && echo late &); echo $x' 'late'
+ktest 'f() { sleep 0.1 && echo late & }; echo $(f; echo early)' 'early late'
+ktest 'for i in 1 2 3; do echo $i > /dev/null & done; wait; echo done' 'done'
+
+# parallel job pool
+ktest 'parallel -j 2 echo item ::: a b c | sort' 'item a
+item b
+item c'
+ktest 'printf "%s\\n" x y | parallel echo | sort' 'x
+y'
+ktest 'parallel -n 2 echo ::: 1 2 3 4 5 | sort' '1 2
+3 4
+5'
+ktest 'parallel -j 2 -X echo ::: 1 2 3 4 5 | sort' '1 2 3
+4 5'
+ktest 'parallel -j 4 sh -c "sleep 0.\$0; echo \$0" ::: 3 1 2' '1
+2
+3'
+ktest 'f() { echo "<$1>"; }; parallel f ::: a' '<a>'
+ktest 'parallel -j 1 sh -c "exit \$0" ::: 0 1 2; echo $?' '2' 'parallel: job 2 (sh -c exit $0 1) failed with exit status 1
+parallel: job 3 (sh -c exit $0 2) failed with exit status 2'
+ktest 'parallel -j 2 sh -c "echo a\$0; sleep 0.\$0; echo b\$0" ::: 1 3 | tr -d "\\n"' 'a1b1a3b3'
+ktest 'parallel -j 1 -X echo ::: $(seq 100000) | wc -l' '1'
+ktest 'parallel -j 0 echo ::: a' '' 'parallel: -j needs a positive number
+parallel: parallel [-j jobs] [-n max-args | -X] [-u] command [arguments...] [::: items...]' 255
+ktest 'sleep 0.3 & parallel true ::: a b; wait $!; echo $?' '0'
+
+# children are reaped in the order they finish
+ktest 'sleep 0.2 | sh -c "exit 3"; echo $?' '3'
+ktest 'sh -c "exit 3" | sleep 0.1; echo $?' '0'
+ktest 'sh -c "kill -9 \$\$"; echo $?' '137'
+ktest 'sh -c "kill -9 \$\$" | true; true | sh -c "kill -15 \$\$"; echo $?' '143'
+ktest 'echo $(sh -c "exit 4"; echo $?)' '4'
+
+ktest 'false | true; echo $?' '0'
+ktest 'set -o pipefail; false | true; echo $?' '1'
+ktest 'set -o pipefail; sh -c "exit 2" | sh -c "exit 3" | true; echo $?' '3'
+ktest 'set -o pipefail; set +o pipefail; false | true; echo $?' '0'
+ktest 'set -o pipefail; ! false | true; echo $?' '0'
+ktest 'set -o; set -o pipefail; set +o' 'pipefail	off
+bytecode	off
+set -o pipefail
+set +o bytecode'
+ktest 'echo $(set -o pipefail); false | true; echo $?' '
+0'
+ktest 'false | true | sh -c "exit 3"; echo $PIPESTATUS' '1 0 3'
+ktest '! true | false; echo $PIPESTATUS' '0 1'
+ktest 'false; echo $PIPESTATUS; true; echo $PIPESTATUS' '1
+0'
+ktest '{ true | false; }; echo $PIPESTATUS' '0 1'
+ktest 'set -- a b; echo $# $2' '2 b'
+
+ktest 'f() { echo old; f() { echo new; }; echo still-old; }; f; f' 'old
+still-old
+new'
+ktest 'for i in 1 2; do f() { echo $i; }; f; done; f' '1
+2
+2'
+
+ktest 'for i in 1 2; do for j in a b; do printf %s $i$j; done; done' '1a1b2a2b'
+ktest 'for i in 1 2; do echo $i > "'"$tmpfile"'-$i"; done; cat "'"$tmpfile"'-1" "'"$tmpfile"'-2"; rm "'"$tmpfile"'-1" "'"$tmpfile"'-2"' '1
+2'
+ktest 'f() { echo "[$1]"; [ -n "$2" ] && f $2 $3; echo $1; }; f 1 2 3' '[1]
+[2]
+[3]
+3
+2
+1'
+
+ktest "echo 'g() { echo defined in \$1; }' > '${tmpfile}-functions'; source '${tmpfile}-functions'; rm '${tmpfile}-functions'; g source" 'defined in source'
+ktest "echo 'echo ran; if true; then :; fi' > '${tmpfile}-syntax'; '$KISH' -n '${tmpfile}-syntax'; echo \$?; rm '${tmpfile}-syntax'" '0'
+ktest "echo 'echo ran; if true; then :;' > '${tmpfile}-syntax'; '$KISH' -n '${tmpfile}-syntax'; echo \$?; rm '${tmpfile}-syntax'" '1' "Syntax error: Either one of 'elif', 'else', 'fi' expected, but got to the end of input"
+
+ktest 'set -- a "b c"; for w in x"$@"'"''"' "pre $1 post" ~nosuchuser_kish; do echo "[$w]"; done; HOME=/h; echo a:~ ~ "~"' '[xa]
+[b c]
+[pre a post]
+[~nosuchuser_kish]
+a:/h /h ~'
+ktest 'for i in 1 2; do echo "$(echo in $i)"$(echo a  b); done; f() { echo $(echo $1); }; f x; f y' 'in 1a b
+in 2a b
+x
+y'
+ktest 'echo ok; echo $(fi); echo after' 'ok
+
+after' "Syntax error: Unexpected token 'fi'"
+
+ktest 'set -o bytecode; f() { for i in 1 2 3; do if [ $i = 2 ]; then echo two; elif [ $i = 3 ]; then echo three; else echo other; fi; done; while false; do :; done; until true; do :; done; true && echo and; false || echo or; ! true; echo $?; }; f' 'other
+two
+three
+and
+or
+1'
+ktest 'set -o bytecode; f() { { echo a; echo b; } > "'"$tmpfile"'-vm"; cat "'"$tmpfile"'-vm"; rm "'"$tmpfile"'-vm"; }; f' 'a
+b'
+ktest 'set -o bytecode; f() { echo "[$1]"; [ -n "$2" ] && f $2; echo $1; }; f 1 2; g() { echo old; g() { echo new; }; }; g; g' '[1]
+[2]
+2
+1
+old
+new'
+ktest "'$KISH' -o bytecode -c 'for i in a b; do echo \$i; done; set +o'" 'a
+b
+set +o pipefail
+set -o bytecode'
+
+ktest 'printf "%s\\n" "echo first" "echo \"echo appended\" >> '"$tmpfile"'-s" > '"$tmpfile"'-s; '"$KISH"' '"$tmpfile"'-s; rm '"$tmpfile"'-s' 'first
+appended'
+ktest 'printf "%s\\n" "echo before" fi "echo after" > '"$tmpfile"'-s; '"$KISH"' '"$tmpfile"'-s; echo $?; rm '"$tmpfile"'-s' 'before
+1' "Syntax error: Unexpected token 'fi'"
+ktest 'printf "%s\\n" "f() {" "  if true" "  then echo \"multi" "line\" \\" continued "  fi" "}" "f; x=\$(echo a" "echo b)" "echo \$x" > '"$tmpfile"'-s; '"$KISH"' '"$tmpfile"'-s; rm '"$tmpfile"'-s' 'multi
+line continued
+ab'
+ktest '{ for i in $(seq 3000); do echo "echo line$i # a comment"; done; } > '"$tmpfile"'-s; '"$KISH"' '"$tmpfile"'-s | wc -l; rm '"$tmpfile"'-s' '3000'
+ktest 'echo x\
+\$y "a\
+b" \
+c' 'x$y ab c'
+ktest 'echo a # comment
+echo b' 'a
+b'
+ktest 'echo "echo piped" | '"$KISH"' /dev/stdin' 'piped'
+ktest 'printf "echo one\\necho two" > '"$tmpfile"'-s; '"$KISH"' '"$tmpfile"'-s; rm '"$tmpfile"'-s' 'one
+two'
+
+# Scripts big enough to be stored in the AST cache
+export XDG_CACHE_HOME="$tmpfile-cache"
+{
+        echo 'HOME=/h'
+        echo 'f() { for w in "$@"; do if [ $w = b ]; then echo "<$(echo $w)>"; elif ! false; then echo ~/$w; else :; fi; done; }'
+        echo 'x=1; while [ $x = 1 ]; do x=2; { f a b; } > /dev/stdout; done'
+        echo 'until true; do :; done && echo done || echo fail'
+        for i in $(seq 100); do echo "# padding, so that the script is worth caching: $i"; done
+        echo 'f c | cat'
+} > "$tmpfile-cached"
+{ echo fi; for i in $(seq 100); do echo "# padding, so that the script is worth caching: $i"; done; } > "$tmpfile-broken"
+ktest "'$KISH' '$tmpfile-cached'; '$KISH' '$tmpfile-cached'; ls '$XDG_CACHE_HOME/kish' | wc -l" '/h/a
+<b>
+done
+/h/c
+/h/a
+<b>
+done
+/h/c
+1'
+ktest "echo 'echo changed' >> '$tmpfile-cached'; '$KISH' '$tmpfile-cached'" '/h/a
+<b>
+done
+/h/c
+changed'
+ktest "rm -r '$XDG_CACHE_HOME'; '$KISH' --compile '$tmpfile-cached'; ls '$XDG_CACHE_HOME/kish' | wc -l; '$KISH' '$tmpfile-cached' | tail -n 1" '1
+changed'
+ktest "'$KISH' --compile '$tmpfile-broken'; echo \$?; ls '$XDG_CACHE_HOME/kish' | wc -l; rm -r '$XDG_CACHE_HOME' '$tmpfile-cached' '$tmpfile-broken'" '1
+1' "Syntax error: Unexpected token 'fi'"
 
 [ $failed -eq 0 ]
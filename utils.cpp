@@ -1,5 +1,12 @@
 #include "utils.h"
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include <sys/wait.h>
 #include "Global.h"
 #include <algorithm>
@@ -118,5 +125,56 @@ std::string_view remove_utf8_prefix(std::string_view view, std::size_t prefix) {
     return view;
 }
 
+bool write_all(int fd, std::string_view data) {
+    while(!data.empty()) {
+        ssize_t written = write(fd, data.data(), data.size());
+        if(written == -1) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data.remove_prefix(written);
+    }
+    return true;
+}
+
+int create_anonymous_file(const char *name) {
+#ifdef __linux__
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if(fd != -1 || errno != ENOSYS)
+        return fd;
+#else
+    (void) name;
+#endif
+    FILE *file = tmpfile();
+    if(file == nullptr)
+        return -1;
+    int fd_copy = fcntl(fileno(file), F_DUPFD_CLOEXEC, 0);
+    fclose(file);
+    return fd_copy;
+}
+
+bool read_whole_file(int fd, std::string &out) {
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+        return false;
+
+    std::size_t old_size = out.size();
+    std::size_t size = static_cast<std::size_t>(st.st_size);
+    out.resize(old_size + size);
+
+    std::size_t done = 0;
+    while(done < size) {
+        ssize_t nread = pread(fd, out.data() + old_size + done, size - done, static_cast<off_t>(done));
+        if(nread == -1 && errno == EINTR)
+            continue;
+        if(nread <= 0)
+            break;
+        done += static_cast<std::size_t>(nread);
+    }
+    out.resize(old_size + done);
+
+    return done == size;
+}
 
 } // namespace utils
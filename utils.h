@@ -165,4 +165,13 @@ std::string_view remove_utf8_prefix(std::string_view view, std::size_t prefix);
 
 std::string common_prefix(const std::vector<std::string> &strings);
 
+// write(2) all of `data`, retrying on partial writes and EINTR
+bool write_all(int fd, std::string_view data);
+
+// An unnamed, close-on-exec temporary file kept in memory where possible. Returns -1 on failure
+int create_anonymous_file(const char *name);
+
+// Appends the whole contents of a regular file to `out`, no matter the current file offset
+bool read_whole_file(int fd, std::string &out);
+
 } // namespace util